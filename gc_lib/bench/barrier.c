@@ -0,0 +1,51 @@
+#include "bench.h"
+
+// Store heavy mutator: young leaves are stored 16 times each into random
+// slots of old parents and of one huge vector. Build with and without
+// USE_CARD_MARKING to compare the write barriers, cards only rescan the
+// dirty 512 byte ranges of the vector.
+
+int main() {
+  gcInit();
+
+  const int  parents = 100000;
+  const int  slots   = 8;
+  const int  vector  = 100000;
+  const long stores  = 20000000;
+
+  Root = alloc(2);
+  setSlot(Root, 0, alloc(parents));
+  setSlot(Root, 1, alloc(vector));
+  ObjectHeader * old = getSlot(Root, 0);
+  ObjectHeader * big = getSlot(Root, 1);
+  for (int i = 0; i < parents; i++) {
+    setSlot(old, i, alloc(slots));
+  }
+  // Everything allocated so far is old
+  gcForceRun();
+
+  srand(90);
+  double start = now();
+  ObjectHeader * leaf = NULL;
+  for (long i = 0; i < stores; i++) {
+    if (i % 16 == 0) {
+      leaf = alloc(0);
+    }
+    if (i % 4 == 0) {
+      setSlot(big, rand() % vector, leaf);
+    } else {
+      setSlot(getSlot(old, rand() % parents), rand() % slots, leaf);
+    }
+  }
+  double took = now() - start;
+
+#ifdef USE_CARD_MARKING
+  const char * barrier = "card marking";
+#else
+  const char * barrier = "mark buffer";
+#endif
+  printf("%-12s : %6.2f ns/store (%ld stores)\n",
+      barrier, took * 1e9 / stores, stores);
+
+  gcTeardown();
+}
@@ -0,0 +1,60 @@
+#ifndef H_BENCH
+#define H_BENCH
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "../gc.h"
+
+// Shared by the benchmarks, each of them is a single source file including
+// this header once. Root is the only root, gcMarkWrapper records how long
+// the marking took in markTime.
+
+static ObjectHeader * Root     = NULL;
+static double         markTime = 0;
+
+static inline double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+void gcMarkWrapper() {
+  double start = now();
+  if (Root != NULL) gcForward(Root);
+  gcMark();
+  markTime = now() - start;
+}
+
+// Objects of size bytes with length slots
+static inline ObjectHeader * allocSized(int length, size_t size) {
+  ObjectHeader * o = gcAlloc(size, 0);
+  o->length = length;
+  for (int i = 0; i < length; i++) {
+    ((ObjectHeader**)(o+1))[i] = NULL;
+  }
+  return o;
+}
+
+static inline ObjectHeader * alloc(int length) {
+  return allocSized(length, sizeof(ObjectHeader) +
+                            length * sizeof(ObjectHeader*));
+}
+
+static inline size_t sizeOf(ObjectHeader * o) {
+  return sizeof(ObjectHeader) + o->length * sizeof(ObjectHeader*);
+}
+
+static inline void setSlot(ObjectHeader * parent, int index,
+                           ObjectHeader * child) {
+  ObjectHeader ** slot = ((ObjectHeader**)(parent+1)) + index;
+  *slot = child;
+  if (child != NULL) gcWriteBarrierSlot(parent, slot);
+}
+
+static inline ObjectHeader * getSlot(ObjectHeader * parent, int index) {
+  return ((ObjectHeader**)(parent+1))[index];
+}
+
+#endif
@@ -0,0 +1,38 @@
+#include <sys/resource.h>
+
+#include "bench.h"
+
+// Bursts of short lived lists, each burst in a different size segment, so
+// arenas emptied by one burst are needed by the next in another segment.
+// Pass the arena pool size as argument (0 disables the pool).
+
+int main(int argc, char ** argv) {
+  gcInit();
+  int pool = argc > 1 ? atoi(argv[1]) : 32;
+  gcSetArenaPool(pool, 16);
+
+  const int    rounds  = 200;
+  const size_t burst   = 64 * 1024 * 1024;
+  const size_t sizes[] = {32, 64, 128, 256};
+
+  Root = allocSized(1, sizeof(ObjectHeader) + sizeof(ObjectHeader*));
+
+  double start = now();
+  for (int r = 0; r < rounds; r++) {
+    size_t size = sizes[r % 4];
+    for (size_t b = 0; b < burst; b += size) {
+      ObjectHeader * o = allocSized(1, size);
+      setSlot(o, 0, ((ObjectHeader**)(Root+1))[0]);
+      setSlot(Root, 0, o);
+    }
+    setSlot(Root, 0, NULL);
+  }
+  double took = now() - start;
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("arena pool %2d : %.2f s, %ld minor faults, maxrss %ld MB\n",
+      pool, took, usage.ru_minflt, usage.ru_maxrss / 1024);
+
+  gcTeardown();
+}
@@ -0,0 +1,34 @@
+#include <sys/resource.h>
+
+#include "bench.h"
+
+// Allocates and drops vectors of 1 MB to 10 MB at a high rate while a few of
+// them stay alive. Pass the large mapping cache size in MB as argument (0
+// disables the cache).
+
+int main(int argc, char ** argv) {
+  gcInit();
+  int cache = argc > 1 ? atoi(argv[1]) : 512;
+  gcSetLargeMappingCache((size_t)cache << 20, 16);
+
+  const int  slots    = 16;
+  const long vectors  = 2000;
+  const int  megabyte = 1024 * 1024 / sizeof(ObjectHeader*);
+
+  srand(90);
+  Root = alloc(slots);
+
+  double start = now();
+  for (long v = 0; v < vectors; v++) {
+    int length = megabyte + rand() % (9 * megabyte);
+    setSlot(Root, rand() % slots, alloc(length));
+  }
+  double took = now() - start;
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("large mapping cache %3d MB : %.2f s, %ld minor faults, maxrss %ld MB\n",
+      cache, took, usage.ru_minflt, usage.ru_maxrss / 1024);
+
+  gcTeardown();
+}
@@ -0,0 +1,32 @@
+#include "bench.h"
+
+// Keeps 4000 (or as many as passed) large objects of 2 MB alive, of which
+// only the header pages are touched, and reports the pause minus the marking
+// of full GCs. Nothing dies, all of it is the cost of the surviving objects.
+
+int main(int argc, char ** argv) {
+  gcInit();
+
+  const long objects = argc > 1 ? atol(argv[1]) : 4000;
+  const int  rounds  = 10;
+
+  // Collect only when forced
+  gcSetHeapTarget((size_t)(objects * 2 + 1024) << 20);
+
+  Root = alloc(objects);
+  for (long i = 0; i < objects; i++) {
+    setSlot(Root, i, allocSized(0, 2 << 20));
+  }
+
+  double sweep = 0, mark = 0;
+  for (int r = 0; r < rounds; r++) {
+    double start = now();
+    gcForceRun();
+    sweep += now() - start - markTime;
+    mark  += markTime;
+  }
+  printf("%ld live large objects : %.3f ms to sweep (mark %.3f ms)\n",
+      objects, sweep * 1000 / rounds, mark * 1000 / rounds);
+
+  gcTeardown();
+}
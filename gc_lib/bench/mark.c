@@ -0,0 +1,63 @@
+#include "bench.h"
+
+// Marks a heap of more than 2 GB of randomly linked nodes. Every node links
+// to the next node of a random permutation, which keeps all of them
+// reachable, and to one random node. Build with and without
+// USE_MARK_PREFETCH and compare under `perf stat -e cache-misses`, with
+// HUGE_PAGES under `perf stat -e dTLB-load-misses`.
+
+int main() {
+  gcInit();
+#ifdef HUGE_PAGES
+  gcEnableHugePages(1);
+#endif
+
+  const long nodes  = 36000000;
+  const int  rounds = 3;
+
+  ObjectHeader ** all = malloc(nodes * sizeof(ObjectHeader*));
+  if (all == NULL) {
+    fatalError("Out of memory");
+  }
+
+  // Chained in allocation order until all nodes exist
+  Root = alloc(1);
+  for (long i = 0; i < nodes; i++) {
+    all[i] = alloc(2);
+    setSlot(all[i], 0, Root->length ? ((ObjectHeader**)(Root+1))[0] : NULL);
+    setSlot(Root, 0, all[i]);
+  }
+
+  srand(90);
+  for (long i = nodes - 1; i > 0; i--) {
+    long j = ((long)rand() * RAND_MAX + rand()) % (i + 1);
+    ObjectHeader * t = all[i];
+    all[i] = all[j];
+    all[j] = t;
+  }
+  setSlot(Root, 0, all[0]);
+  for (long i = 0; i < nodes; i++) {
+    setSlot(all[i], 0, i + 1 < nodes ? all[i + 1] : NULL);
+    setSlot(all[i], 1, all[((long)rand() * RAND_MAX + rand()) % nodes]);
+  }
+  free(all);
+
+#ifdef USE_MARK_PREFETCH
+  const char * loop = "prefetching";
+#else
+  const char * loop = "plain";
+#endif
+  double best = 0;
+  for (int r = 0; r < rounds; r++) {
+    gcForceRun();
+    if (r == 0 || markTime < best) best = markTime;
+  }
+  printf("%-11s : %.2f s to mark %ld nodes (%.1f ns/node, %ld MB)\n",
+      loop, best, nodes, best * 1e9 / nodes,
+      nodes * 64 / (1024 * 1024));
+#ifdef HUGE_PAGES
+  printf("%-11s   %d arenas got huge pages\n", "", gcCountHugePageArenas());
+#endif
+
+  gcTeardown();
+}
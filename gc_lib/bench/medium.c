@@ -0,0 +1,63 @@
+#include <sys/resource.h>
+
+#include "bench.h"
+
+// Keeps a fixed live set of about 160 MB of objects of 1 KB to 64 KB (or as
+// many KB as passed) and replaces random ones of them. Compares the peak RSS
+// to the bytes actually requested, like sizes.c does for the small objects.
+// Every object stores its length in its last slot, which is checked when it
+// is replaced.
+
+static int maxLength;
+
+ObjectHeader * allocMedium() {
+  int length = 128 + rand() % (maxLength - 128 - 2);
+  ObjectHeader * o = alloc(length);
+  // Odd, thus never taken for a pointer
+  ((long*)(o+1))[length - 1] = 2L * length + 1;
+  o->length = length - 1;
+  return o;
+}
+
+void check(ObjectHeader * o) {
+  if (((long*)(o+1))[o->length] != 2L * (o->length + 1) + 1) {
+    fprintf(stderr, "object %p was overwritten\n", (void*)o);
+    exit(1);
+  }
+}
+
+int main(int argc, char ** argv) {
+  gcInit();
+
+  maxLength = (argc > 1 ? atoi(argv[1]) : 64) * 1024 / sizeof(ObjectHeader*);
+  const int  objects  = (160L << 20) / (maxLength * sizeof(ObjectHeader*) / 2);
+  const long replaces = 40L * objects;
+
+  srand(90);
+  Root = alloc(objects);
+  size_t live = 0;
+  for (int i = 0; i < objects; i++) {
+    ObjectHeader * o = allocMedium();
+    live += sizeOf(o) + sizeof(long);
+    setSlot(Root, i, o);
+  }
+
+  double start = now();
+  for (long r = 0; r < replaces; r++) {
+    int i = rand() % objects;
+    ObjectHeader * old = ((ObjectHeader**)(Root+1))[i];
+    check(old);
+    live -= sizeOf(old) + sizeof(long);
+    ObjectHeader * o = allocMedium();
+    live += sizeOf(o) + sizeof(long);
+    setSlot(Root, i, o);
+  }
+  double took = now() - start;
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("live %ld MB, maxrss %ld MB, %.2f s\n",
+      live / (1024 * 1024), usage.ru_maxrss / 1024, took);
+
+  gcTeardown();
+}
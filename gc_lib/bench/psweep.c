@@ -0,0 +1,42 @@
+#include "bench.h"
+
+// Sweeps a heap of 4 GB (or as many GB as passed) of 64 byte nodes, of which
+// every eighth is reachable, with 1, 2, 4 and 8 gc threads. The dead nodes
+// are allocated again before every GC. Reports the pause minus the marking,
+// which is the sweeping and, with USE_MARK_BITMAP, the clearing of the marks.
+
+int main(int argc, char ** argv) {
+  gcInit();
+
+  const long   gb    = argc > 1 ? atol(argv[1]) : 4;
+  const long   nodes = (gb << 30) / 64;
+  const int    threads[] = {1, 2, 4, 8};
+
+  // Collect only when forced
+  gcSetHeapTarget((size_t)(gb + 2) << 30);
+
+  Root = alloc(1);
+  for (long i = 0; i < nodes; i++) {
+    ObjectHeader * o = alloc(5);
+    if (i % 8 == 0) {
+      setSlot(o, 0, ((ObjectHeader**)(Root+1))[0]);
+      setSlot(Root, 0, o);
+    }
+  }
+
+  for (int t = 0; t < 4; t++) {
+    gcSetMarkThreads(threads[t]);
+    if (t > 0) {
+      for (long i = 0; i < nodes - nodes / 8; i++) {
+        alloc(5);
+      }
+    }
+    double start = now();
+    gcForceRun();
+    double sweep = now() - start - markTime;
+    printf("%d threads : %.3f s to sweep %ld MB (mark %.3f s)\n",
+        threads[t], sweep, (nodes * 64) >> 20, markTime);
+  }
+
+  gcTeardown();
+}
@@ -0,0 +1,47 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+// Runs a program, e.g. the test.c workload, with its output discarded and
+// reports its peak RSS and run time. Compare across commits, dead objects
+// the sweeper misses show up as a higher peak.
+
+double now() {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+int main(int argc, char ** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s program [args...]\n", argv[0]);
+    return 1;
+  }
+
+  double start = now();
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (freopen("/dev/null", "w", stdout) == NULL) _exit(127);
+    execv(argv[1], argv + 1);
+    _exit(127);
+  }
+
+  int status;
+  struct rusage usage;
+  if (pid < 0 || wait4(pid, &status, 0, &usage) < 0) {
+    perror("wait4");
+    return 1;
+  }
+  double took = now() - start;
+
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    printf("%s failed\n", argv[1]);
+    return 1;
+  }
+  printf("%-16s : maxrss %ld MB, %.2f s\n",
+      argv[1], usage.ru_maxrss / 1024, took);
+  return 0;
+}
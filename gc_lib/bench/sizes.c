@@ -0,0 +1,46 @@
+#include <sys/resource.h>
+
+#include "bench.h"
+
+// Keeps a fixed live set of objects with 1 to 57 slots, the sizes test.c
+// allocates, and replaces random ones of them. Compares the peak RSS to the
+// bytes actually requested to show how much the size classes round up.
+
+int main() {
+  gcInit();
+
+  const int  tables   = 1000;
+  const int  entries  = 1000;
+  const long replaces = 10000000;
+
+  srand(90);
+  Root = alloc(tables);
+  size_t live = 0;
+  for (int t = 0; t < tables; t++) {
+    setSlot(Root, t, alloc(entries));
+    ObjectHeader * table = ((ObjectHeader**)(Root+1))[t];
+    for (int e = 0; e < entries; e++) {
+      ObjectHeader * o = alloc(1 + rand() % 57);
+      live += sizeOf(o);
+      setSlot(table, e, o);
+    }
+  }
+
+  double start = now();
+  for (long i = 0; i < replaces; i++) {
+    ObjectHeader * table = ((ObjectHeader**)(Root+1))[rand() % tables];
+    int e = rand() % entries;
+    live -= sizeOf(((ObjectHeader**)(table+1))[e]);
+    ObjectHeader * o = alloc(1 + rand() % 57);
+    live += sizeOf(o);
+    setSlot(table, e, o);
+  }
+  double took = now() - start;
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("live %ld MB, maxrss %ld MB, %.2f s\n",
+      live / (1024 * 1024), usage.ru_maxrss / 1024, took);
+
+  gcTeardown();
+}
@@ -0,0 +1,55 @@
+#include "bench.h"
+
+// Sweeps one 32 byte segment arena with a given share of surviving objects
+// using each of the bytemap sweep kernels.
+
+ArenaHeader * allocateAlignedArena(int class, int segment);
+uintptr_t getArenaEnd(ArenaHeader * arena);
+void sweepArena(ArenaHeader * arena);
+
+int main() {
+  gcInit();
+
+  const int   rounds      = 200;
+  const float survivals[] = {0.05, 0.5, 0.95};
+  const char * names[]    = {"scalar", "sse2", "avx2"};
+  const int    kernels[]  = {GC_SWEEP_SCALAR, GC_SWEEP_SSE2, GC_SWEEP_AVX2};
+
+  ArenaHeader * arena = allocateAlignedArena(0, 0);
+  // Pretend the arena is completely allocated
+  arena->free      = (void*)getArenaEnd(arena);
+  arena->num_alloc = arena->num_objects;
+
+  for (int s = 0; s < 3; s++) {
+    srand(90);
+    char *        bm   = getBytemap(arena);
+    unsigned long live = 0;
+    for (int i = 0; i < arena->num_objects; i++) {
+      bm[i] = (rand() / (float)RAND_MAX) < survivals[s] ?
+        BLACK_MARK : WHITE_MARK;
+      live += bm[i] == BLACK_MARK;
+    }
+    // As counted by the marking, an arena without marks is not swept
+    arena->live_count = ((unsigned long)gcMarkEpoch << LIVE_EPOCH_SHIFT) |
+                        live;
+
+    for (int k = 0; k < 3; k++) {
+      if (!gcSetSweepKernel(kernels[k])) {
+        printf("survival %2.0f%% %-6s : not supported\n",
+            survivals[s] * 100, names[k]);
+        continue;
+      }
+      sweepArena(arena);
+      double start = now();
+      for (int r = 0; r < rounds; r++) {
+        sweepArena(arena);
+      }
+      double took = now() - start;
+      printf("survival %2.0f%% %-6s : %6.2f ns/object (%d live)\n",
+          survivals[s] * 100, names[k],
+          took * 1e9 / rounds / arena->num_objects, arena->num_alloc);
+    }
+  }
+
+  return 0;
+}
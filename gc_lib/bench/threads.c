@@ -0,0 +1,49 @@
+#include <pthread.h>
+
+#include "bench.h"
+
+// Allocation throughput of 1 to 16 registered mutator threads, each building
+// short lived lists of small objects. With thread-local arenas the rate
+// should grow with the threads up to the number of cores.
+
+#define MAX_THREADS 16
+
+static const long allocations = 4000000;
+
+void * mutator(void * arg) {
+  long thread = (long)arg;
+  gcRegisterThread();
+  for (long a = 0; a < allocations; a++) {
+    // Lists of 1000 objects of 16 to 72 bytes
+    if (a % 1000 == 0) setSlot(Root, thread, NULL);
+    ObjectHeader * o = alloc(1 + a % 8);
+    setSlot(o, 0, ((ObjectHeader**)(Root+1))[thread]);
+    setSlot(Root, thread, o);
+  }
+  gcUnregisterThread();
+  return NULL;
+}
+
+int main() {
+  gcInit();
+  Root = alloc(MAX_THREADS);
+  // The main thread only waits, a GC must not wait for it
+  gcUnregisterThread();
+
+  for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+    pthread_t ids[MAX_THREADS];
+    double start = now();
+    for (long t = 0; t < threads; t++) {
+      pthread_create(&ids[t], NULL, mutator, (void*)t);
+    }
+    for (int t = 0; t < threads; t++) {
+      pthread_join(ids[t], NULL);
+    }
+    double took = now() - start;
+    printf("%2d threads : %6.1f M allocations/s\n",
+        threads, threads * allocations / took / 1e6);
+  }
+
+  gcRegisterThread();
+  gcTeardown();
+}
@@ -0,0 +1,85 @@
+#ifndef H_DEQUE
+#define H_DEQUE
+
+// Fixed size work-stealing deque (Chase-Lev). Only the owner pushes and pops
+// at the bottom, other threads steal from the top.
+
+typedef struct MarkDeque MarkDeque;
+
+#define MarkDequeSize 4096
+#define MarkDequeMask (MarkDequeSize-1)
+struct MarkDeque {
+  long top;
+  long bottom;
+  ObjectHeader * entry[MarkDequeSize];
+};
+
+#define DEQUE_ABORT ((ObjectHeader*)1)
+
+inline void dequeInit(MarkDeque * deque) {
+  deque->top    = 0;
+  deque->bottom = 0;
+}
+
+inline int dequeEmpty(MarkDeque * deque) {
+  return __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE) >=
+         __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+}
+
+// Returns 0 if the deque is full
+inline int dequePush(MarkDeque * deque, ObjectHeader * o) {
+  long b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED);
+  long t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  if (b - t >= MarkDequeSize) {
+    return 0;
+  }
+  __atomic_store_n(&deque->entry[b & MarkDequeMask], o, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+inline ObjectHeader * dequePop(MarkDeque * deque) {
+  long b = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+  __atomic_store_n(&deque->bottom, b, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long t = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+
+  if (t > b) {
+    __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  ObjectHeader * o = __atomic_load_n(&deque->entry[b & MarkDequeMask],
+                                     __ATOMIC_RELAXED);
+  if (t == b) {
+    // Last entry, race against thieves
+    if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, 0,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+      o = NULL;
+    }
+    __atomic_store_n(&deque->bottom, b + 1, __ATOMIC_RELAXED);
+  }
+  return o;
+}
+
+// Returns DEQUE_ABORT if another thread won the race for the top entry
+inline ObjectHeader * dequeSteal(MarkDeque * deque) {
+  long t = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long b = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+
+  if (t >= b) {
+    return NULL;
+  }
+
+  ObjectHeader * o = __atomic_load_n(&deque->entry[t & MarkDequeMask],
+                                     __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&deque->top, &t, t + 1, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return DEQUE_ABORT;
+  }
+  return o;
+}
+
+#endif
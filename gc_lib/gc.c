@@ -12,11 +12,17 @@
 #include <string.h>
 
 #include <sys/mman.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <pthread.h>
+#include <sched.h>
 
 #include "gc.h"
 
 #include "debugging.h"
 #include "stack.h"
+#include "deque.h"
 
 
 
@@ -26,18 +32,44 @@
  *
  */
 
-#define NUM_FIXED_HEAP_SEGMENTS 12
+// Four size classes per doubling from 32 bytes to 1 KB:
+//   32, 40, 48, 56, 64, 80, 96, 112, 128, 160, ... , 896, 1024
+#define SEGMENTS_PER_DOUBLING_BITS 2
+#define SEGMENTS_PER_DOUBLING (1<<SEGMENTS_PER_DOUBLING_BITS)
+#define NUM_FIXED_HEAP_SEGMENTS (5*SEGMENTS_PER_DOUBLING + 1)
+// Larger objects up to MAX_LINE_NODE_SIZE take whole 256 byte lines of the
+// line arenas, which are 4 MB arenas as well. Only larger objects still get
+// a mapping of their own.
+#define LINE_SEGMENT NUM_FIXED_HEAP_SEGMENTS
+#define NUM_ARENA_SEGMENTS (NUM_FIXED_HEAP_SEGMENTS + 1)
 #define NUM_VARIABLE_HEAP_SEGMENTS 1
-#define NUM_HEAP_SEGMENTS (NUM_FIXED_HEAP_SEGMENTS + NUM_VARIABLE_HEAP_SEGMENTS)
-#define VARIABLE_LARGE_NODE_SEGMENT NUM_FIXED_HEAP_SEGMENTS
+#define NUM_HEAP_SEGMENTS (NUM_ARENA_SEGMENTS + NUM_VARIABLE_HEAP_SEGMENTS)
+#define VARIABLE_LARGE_NODE_SEGMENT NUM_ARENA_SEGMENTS
 
 #define NUM_CLASSES 2
 
-#define SMALLEST_SEGMENT_SIZE 32
+#define SMALLEST_SEGMENT_BITS 5
+#define SMALLEST_SEGMENT_SIZE (1<<SMALLEST_SEGMENT_BITS)
 #define LARGEST_FIXED_SEGMENT_SIZE \
-  (SMALLEST_SEGMENT_SIZE<<(NUM_FIXED_HEAP_SEGMENTS-1))
+  (SMALLEST_SEGMENT_SIZE<<((NUM_FIXED_HEAP_SEGMENTS-1)/SEGMENTS_PER_DOUBLING))
+
+#define MAX_FIXED_NODE_SIZE LARGEST_FIXED_SEGMENT_SIZE
+
+#define LINE_SIZE_BITS 8
+#define LINE_SIZE (1<<LINE_SIZE_BITS)
+#define MAX_LINE_NODE_SIZE (1024*1024)
+// Shorter free line runs cannot take any object of the line segment
+#define MIN_LINE_RUN ((MAX_FIXED_NODE_SIZE >> LINE_SIZE_BITS) + 1)
+
+// Mappings of large objects come in eight sizes per doubling. Freed ones of
+// 1 MB to 128 MB are cached for reuse by objects of the same size.
+#define LARGE_MAPPING_CLASS_BITS 3
+#define LARGE_MAPPING_MIN_BITS 20
+#define LARGE_MAPPING_MAX_BITS 27
+#define NUM_LARGE_MAPPING_CLASSES \
+  ((LARGE_MAPPING_MAX_BITS - LARGE_MAPPING_MIN_BITS) << LARGE_MAPPING_CLASS_BITS)
 
-#define MAX_FIXED_NODE_SIZE (SMALLEST_SEGMENT_SIZE<<(NUM_FIXED_HEAP_SEGMENTS-1))
+#define MAX_GC_THREADS 64
 
 
 /*
@@ -45,13 +77,72 @@
  *
  */
 
+// Free arenas are kept in bins by occupancy, the allocator takes from the
+// fullest one
+#define FREE_ARENA_BINS 16
+// The free bins followed by the unswept and the full list
+#define NUM_ARENA_LISTS (FREE_ARENA_BINS + 2)
+#define SWEEP_ARENA_LIST FREE_ARENA_BINS
+
 struct HeapStruct {
-  ArenaHeader * free_arena;
+  ArenaHeader * free_arena[FREE_ARENA_BINS];
+  // Flagged by lazy sweeping and not swept yet
+  ArenaHeader * sweep_arena;
   ArenaHeader * full_arena;
-  unsigned long size_limit;
   unsigned long size;
   unsigned long long alloc_count;
   unsigned long long object_count;
+  // Bytes of the allocated objects, arenas claimed by a thread count as
+  // fully allocated until they are handed back
+  size_t             used_bytes;
+};
+
+typedef struct ThreadContext ThreadContext;
+struct ThreadContext {
+  // Arenas claimed by this thread, not linked in any Heap list
+  ArenaHeader *   arena[NUM_CLASSES][NUM_ARENA_SEGMENTS];
+  // Objects greyed by the write barrier of this thread
+  StackChunk *    mark_buffer;
+  // Allocation statistics for the reporting, merged into alloc_avg while
+  // the world is stopped
+  double          alloc_fill[NUM_HEAP_SEGMENTS];
+  unsigned long   alloc_count[NUM_HEAP_SEGMENTS];
+  int             registered;
+  ThreadContext * next;
+};
+
+typedef struct MarkWorker MarkWorker;
+struct MarkWorker {
+  MarkDeque    deque;
+  // Private spill area for when the deque is full
+  StackChunk * overflow;
+};
+
+// An arena to sweep or clear in parallel
+typedef struct SweepItem SweepItem;
+struct SweepItem {
+  ArenaHeader * arena;
+  int           from_full;
+};
+
+// The large objects of a class with the mark epoch they were last counted
+// live in. The sweep finds the dead ones here instead of visiting every
+// header, each of which lies in a mapping of its own. The slots never move,
+// the marker writes the epochs while the world runs.
+typedef struct LargeIndex LargeIndex;
+struct LargeIndex {
+  ArenaHeader **  arena;
+  unsigned char * epoch;
+  unsigned int    size;
+};
+
+// Results of a sweeping thread, merged once all are done
+typedef struct SweepWorker SweepWorker;
+struct SweepWorker {
+  long long     alloc_count[NUM_CLASSES][NUM_HEAP_SEGMENTS];
+  long long     used_bytes[NUM_CLASSES][NUM_HEAP_SEGMENTS];
+  // Empty arenas, linked through next
+  ArenaHeader * released;
 };
 
 
@@ -63,30 +154,51 @@ struct HeapStruct {
 static int gcReportingEnabled = 0;
 
 static HeapStruct   Heap[NUM_CLASSES][NUM_HEAP_SEGMENTS];
+static LargeIndex   LargeObjects[NUM_CLASSES];
 
 static StackChunk * MarkStack;
 
+static __thread ThreadContext LocalThread;
+static ThreadContext *        Threads = NULL;
+static int                    numThreads = 0;
+
+static pthread_mutex_t HeapLock      = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  SafepointCond = PTHREAD_COND_INITIALIZER;
+
+static int          markThreads = 1;
+static MarkWorker * MarkWorkers[MAX_GC_THREADS];
+
+static int concurrentMarkingEnabled  = 0;
+static int incrementalMarkingEnabled = 0;
+static int lazySweepingEnabled       = 0;
+static int backgroundSweepingEnabled = 0;
+static int hugePagesEnabled          = 0;
+
+// Bytes of arenas in the heap (claimed by threads or in the Heap lists)
+static size_t heapSize = 0;
+
 
 /*
  * Heuristic Constants
  *
  */
 
-const float heapGrowFactor                = 1.2;
-const float heapShrinkFactor              = 1.1;
+#define GC_HUGE_PAGE_SIZE (2*1024*1024)
 
-const float minFreedSpaceLimit = 0.15;
-const float maxUsedSpaceLimit  = 0.8;
-
-#define FULL_GC_INTERVAL 35
-#define RELEASE_VARIABLE_ARENAS_INTERVAL 1
+// Heap goal before the first full GC and lower bound afterwards
+#define MIN_HEAP_GOAL (8 * GC_ARENA_SIZE)
+// Partial GCs are pointless once less of the heap goal than this is left
+// for allocation
+const float minPartialRunway   = 0.15;
+// Weight of the latest sample in the allocation and survival rates
+const float pacerSmoothing     = 0.3;
 
 const float arenaFullPercentage           = 0.95;
-const float arenaEmptyPercentage          = 0.05;
+const float arenaGarbagePercentage        = 0.05;
 const float createFreelistThreshold       = 0.3;
 
-const int heapInitNumArena = 1;
-const int heapInitNumVarArena = 30;
+// gcCompact evacuates arenas with less live objects than this
+const float evacuationLiveFraction        = 0.25;
 
 const int gcClassRelation = 40;
 
@@ -100,11 +212,47 @@ const int arenaStartAlign = 64;
 
 extern inline char * getBytemap(ArenaHeader * base);
 extern inline ArenaHeader * chunkFromPtr(void * base);
-extern inline int getObjectBits(ArenaHeader * arena);
+extern inline unsigned int getObjectRecip(ArenaHeader * arena);
 extern inline int getBytemapIndex(void * base, ArenaHeader * arena);
 extern inline uintptr_t getArenaFirst(ArenaHeader * arena);
 
+extern inline int isWhiteMark(char mark);
+#ifndef USE_MARK_BITMAP
 extern inline char * getMark(void * ptr);
+#else
+extern inline MarkWord * getMarkWord(void * ptr);
+extern inline MarkWord getMarkBit(void * ptr);
+#endif
+extern inline int isMarkWhite(void * ptr);
+extern inline int isMarkBlack(void * ptr);
+extern inline void setMarkGrey(void * ptr);
+extern inline void setMarkBlack(void * ptr);
+
+size_t getMarkMapSize(int num_objects) {
+#ifndef USE_MARK_BITMAP
+  return num_objects;
+#else
+  return ((num_objects + MARK_WORD_BITS - 1) / MARK_WORD_BITS) *
+         sizeof(MarkWord);
+#endif
+}
+
+// Line arenas keep the number of lines of every object and free run next to
+// the marks, at the index of its first line
+static inline unsigned short * getLineSpans(ArenaHeader * arena) {
+  return (unsigned short*)(getBytemap(arena) +
+                           getMarkMapSize(arena->num_objects));
+}
+
+static inline int getLineIndex(void * ptr, ArenaHeader * arena) {
+  return ((uintptr_t)ptr - getArenaFirst(arena)) >> LINE_SIZE_BITS;
+}
+
+// Cells taken by the object, the lines of it in a line arena
+static inline unsigned int getObjectCells(void * ptr, ArenaHeader * arena) {
+  if (arena->segment != LINE_SEGMENT) return 1;
+  return getLineSpans(arena)[getLineIndex(ptr, arena)];
+}
 
 void nextObject(ObjectHeader ** o, ArenaHeader * arena) {
   *o = (ObjectHeader*)(((char*)(*o)) + arena->object_size);
@@ -122,6 +270,13 @@ uintptr_t getArenaEnd(ArenaHeader * arena) {
   return getArenaFirst(arena) + (getObjectSize(arena)*getNumObjects(arena));
 }
 
+// End of the space objects were allocated in. Only the first line of an
+// object can be marked, thus a line arena can be walked line by line.
+uintptr_t getArenaTop(ArenaHeader * arena) {
+  if (arena->segment == LINE_SEGMENT) return getArenaEnd(arena);
+  return (uintptr_t)arena->free;
+}
+
 int isAligned(void * base, unsigned int align) {
   return (uintptr_t)base % align == 0;
 }
@@ -143,60 +298,121 @@ size_t roundUpMemory(size_t required, unsigned int align) {
 
 int heapSegmentNodeSize(int segment) {
   assert(segment >= 0 && segment < NUM_FIXED_HEAP_SEGMENTS);
-  return SMALLEST_SEGMENT_SIZE<<segment;
+  if (segment == 0) return SMALLEST_SEGMENT_SIZE;
+  int doubling = (segment - 1) >> SEGMENTS_PER_DOUBLING_BITS;
+  int step     = ((segment - 1) & (SEGMENTS_PER_DOUBLING - 1)) + 1;
+  int base     = SMALLEST_SEGMENT_BITS + doubling;
+  return (1 << base) + (step << (base - SEGMENTS_PER_DOUBLING_BITS));
 }
 
 void clearAllMarks(ArenaHeader * arena) {
-  memset(getBytemap(arena), 0, arena->num_objects);
-  arena->was_full = 0;
+  memset(getBytemap(arena), 0, getMarkMapSize(arena->num_objects));
+#ifdef USE_CARD_MARKING
+  memset(arena->cards, 0, arena->num_cards);
+#endif
+  arena->was_full    = 0;
+  arena->needs_sweep = 0;
+  // Epochs start at 1
+  arena->live_count  = 0;
+}
+
+// Cells marked in the current mark epoch
+static inline unsigned int getLiveCount(ArenaHeader * arena) {
+  unsigned long live = arena->live_count;
+  return (live >> LIVE_EPOCH_SHIFT) == gcMarkEpoch ? (unsigned int)live : 0;
+}
+
+// Called once for every mark turning from white
+static inline void countLiveObject(void * ptr, int concurrent) {
+  ArenaHeader * arena = chunkFromPtr(ptr);
+  unsigned long cells = getObjectCells(ptr, arena);
+  unsigned long epoch = (unsigned long)gcMarkEpoch << LIVE_EPOCH_SHIFT;
+  if (arena->segment >= NUM_ARENA_SEGMENTS) {
+    LargeObjects[arena->gc_class].epoch[arena->large_index] = gcMarkEpoch;
+  }
+  if (!concurrent) {
+    arena->live_count = (epoch | getLiveCount(arena)) + cells;
+    return;
+  }
+  unsigned long live = __atomic_load_n(&arena->live_count, __ATOMIC_RELAXED);
+  while ((live >> LIVE_EPOCH_SHIFT) != gcMarkEpoch) {
+    if (__atomic_compare_exchange_n(&arena->live_count, &live, epoch | cells,
+                                    0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      return;
+    }
+  }
+  __atomic_fetch_add(&arena->live_count, cells, __ATOMIC_RELAXED);
+}
+
+// Cards covering the arena, the card table included
+unsigned int getNumCards(int segment, size_t object_size) {
+#ifdef USE_CARD_MARKING
+  if (segment < NUM_ARENA_SEGMENTS) return GC_NUM_CARDS;
+  size_t extent = sizeof(ArenaHeader) + 2 * arenaStartAlign + object_size;
+  // Whole words, the collector looks for dirty cards word by word
+  return roundUpMemory(extent / ((1 << GC_CARD_BITS) - 1) + 1, sizeof(long));
+#else
+  return 0;
+#endif
 }
 
 size_t calcNumOfObjects(ArenaHeader * arena, int total_size, int object_size) {
   assert(total_size > 1024);
 
   // Area:
-  // arena_offset | AreaHeader | bytemap | start_align | object_space | padding
+  // arena_offset | AreaHeader | bytemap | cards | start_align | object_space
+  // | padding
   //
-  // sizeof(bytemap)      = num_objects
+  // sizeof(bytemap)      = num_objects (bitmap: num_objects / 8, rounded up
+  //                                     to a whole MarkWord)
   // sizeof(object_space) = num_objects * object_size
 
-  int header = sizeof(ArenaHeader) + arenaStartAlign;
+  int header = sizeof(ArenaHeader) + arenaStartAlign +
+               getNumCards(arena->segment, -1);
 
+#ifndef USE_MARK_BITMAP
   int num_objects = (total_size - header) / (1 + object_size);
+#else
+  int num_objects = ((long)(total_size - header - sizeof(MarkWord)) * 8) /
+                    (8 * object_size + 1);
+#endif
 
   assert(num_objects > 0);
-  assert(total_size >= header + num_objects +
+  assert(total_size >= header + getMarkMapSize(num_objects) +
                        (num_objects * object_size));
 
   return (size_t)num_objects;
 }
 
-int __gcSegmentSizeLookupTable[LARGEST_FIXED_SEGMENT_SIZE+1];
-
 int getFixedSegmentForSize(long length) {
-  return (length > LARGEST_FIXED_SEGMENT_SIZE) ?
-    VARIABLE_LARGE_NODE_SEGMENT :
-    __gcSegmentSizeLookupTable[length];
-}
-
-void buildGcSegmentSizeLookupTable() {
-  // Build the lookup tables
-  int segment = 0;
-  for (int size = 0; size <= LARGEST_FIXED_SEGMENT_SIZE; size++) {
-    if (size <= MAX_FIXED_NODE_SIZE) {
-      if (heapSegmentNodeSize(segment) < size) {
-        segment++;
-      }
-      assert(segment == 0 || heapSegmentNodeSize(segment-1) < size);
-      assert(heapSegmentNodeSize(segment) >= size);
-      assert(segment < NUM_FIXED_HEAP_SEGMENTS);
-    } else {
-      segment  = VARIABLE_LARGE_NODE_SEGMENT;
-      assert(size > MAX_FIXED_NODE_SIZE);
+  if (length <= SMALLEST_SEGMENT_SIZE) return 0;
+  if (length > MAX_LINE_NODE_SIZE) return VARIABLE_LARGE_NODE_SEGMENT;
+  if (length > LARGEST_FIXED_SEGMENT_SIZE) return LINE_SEGMENT;
+  // length lies in (1<<base, 1<<(base+1)], split into equal steps
+  int base = 63 - __builtin_clzl(length - 1);
+  int step = ((length - 1 - (1L << base)) >>
+              (base - SEGMENTS_PER_DOUBLING_BITS)) + 1;
+  return ((base - SMALLEST_SEGMENT_BITS) << SEGMENTS_PER_DOUBLING_BITS) + step;
+}
+
+#ifdef DEBUG
+void checkFixedSegmentSizes() {
+  for (long size = 0; size <= MAX_LINE_NODE_SIZE + 1; size++) {
+    int segment = getFixedSegmentForSize(size);
+    if (size > MAX_LINE_NODE_SIZE) {
+      assert(segment == VARIABLE_LARGE_NODE_SEGMENT);
+      continue;
     }
-    __gcSegmentSizeLookupTable[size] = segment;
+    if (size > MAX_FIXED_NODE_SIZE) {
+      assert(segment == LINE_SEGMENT);
+      continue;
+    }
+    assert(segment < NUM_FIXED_HEAP_SEGMENTS);
+    assert(segment == 0 || heapSegmentNodeSize(segment-1) < size);
+    assert(heapSegmentNodeSize(segment) >= size);
   }
 }
+#endif
 
 
 /*
@@ -222,13 +438,34 @@ void * getRealPageStart(ArenaHeader * arena) {
   return (void*)(((uintptr_t)arena & ~GC_ARENA_ALIGN_MASK));
 }
 
+// At most an eighth of the mapping is never used
+size_t getLargeMappingSize(size_t size) {
+  int    bits = 63 - __builtin_clzl(size);
+  size_t step = (size_t)1 << (bits > LARGE_MAPPING_CLASS_BITS ?
+                              bits - LARGE_MAPPING_CLASS_BITS : 0);
+  return (size + step - 1) & ~(step - 1);
+}
+
+// Of a size returned by getLargeMappingSize, -1 if not cached
+int getLargeMappingClass(size_t size) {
+  int bits = 63 - __builtin_clzl(size);
+  if (bits < LARGE_MAPPING_MIN_BITS || bits >= LARGE_MAPPING_MAX_BITS) {
+    return -1;
+  }
+  return ((bits - LARGE_MAPPING_MIN_BITS) << LARGE_MAPPING_CLASS_BITS) +
+         ((size >> (bits - LARGE_MAPPING_CLASS_BITS)) &
+          ((1 << LARGE_MAPPING_CLASS_BITS) - 1));
+}
+
 size_t getRealPageSize(int segment, size_t object_size) {
   size_t size = 0;
-  if (segment < NUM_FIXED_HEAP_SEGMENTS) {
+  if (segment < NUM_ARENA_SEGMENTS) {
     size = GC_ARENA_SIZE;
   } else {
     int header = sizeof(ArenaHeader) + arenaStartAlign;
-    size = object_size + header;
+    size = getLargeMappingSize(object_size + header +
+                               roundUpMemory(getNumCards(segment, object_size),
+                                             arenaStartAlign));
   }
   int OSPageAlignment = sysconf(_SC_PAGESIZE);
   return roundUpMemory(size, OSPageAlignment);
@@ -299,12 +536,26 @@ ArenaHeader * allocateAligned(size_t variable_length) {
   assert(request_length = prefix + aligned_length + suffix);
 
   // Reserve memory for the aligned block
-  commited = mmap(aligned_base_ptr,
-                  aligned_length,
-                  PROT_READ | PROT_WRITE,
-                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
-                  -1,
-                  0);
+  commited = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (hugePagesEnabled && aligned_length % GC_HUGE_PAGE_SIZE == 0) {
+    // Only succeeds if the admin reserved hugetlb pages
+    commited = mmap(aligned_base_ptr,
+                    aligned_length,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB,
+                    -1,
+                    0);
+  }
+#endif
+  if (commited == MAP_FAILED) {
+    commited = mmap(aligned_base_ptr,
+                    aligned_length,
+                    PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+                    -1,
+                    0);
+  }
   if (commited != aligned_base_ptr) {
     munmap(aligned_base_ptr, aligned_length);
     return NULL;
@@ -313,35 +564,233 @@ ArenaHeader * allocateAligned(size_t variable_length) {
   assert(commited == aligned_base_ptr);
 #endif
 
+#ifdef MADV_HUGEPAGE
+  if (hugePagesEnabled) {
+    // Arenas are aligned to huge pages and start with their bytemap. Fails
+    // silently if THP is disabled and on hugetlb mappings.
+    madvise(commited, aligned_length, MADV_HUGEPAGE);
+  }
+#endif
+
   ArenaHeader * arena = (ArenaHeader*)((uintptr_t)commited);
 
   assert(getRealPageStart(arena) == commited);
   return arena;
 }
 
+// Empty fixed size arenas are kept mapped for reuse by any class and
+// segment, released after arenaPoolMaxAge GCs
+static ArenaHeader * ArenaPool        = NULL;
+static int           arenaPoolSize    = 0;
+static int           arenaPoolLimit   = 32;
+static int           arenaPoolMaxAge  = 16;
+static unsigned long gcCount          = 0;
+
+void unmapArena(ArenaHeader * arena) {
+#ifdef USE_POSIX_MEMALIGN
+  free(getRealPageStart(arena));
+#else
+  munmap(getRealPageStart(arena), getRealPageSizeFromArena(arena));
+#endif
+}
+
+ArenaHeader * takePooledArena() {
+  ArenaHeader * arena = ArenaPool;
+  if (arena != NULL) {
+    ArenaPool = arena->next;
+    arenaPoolSize--;
+  }
+  return arena;
+}
+
+// The pool is ordered by decreasing idle_since
+void trimArenaPool() {
+  ArenaHeader ** prev = &ArenaPool;
+  int kept = 0;
+  while (*prev != NULL) {
+    ArenaHeader * arena = *prev;
+    if (kept < arenaPoolLimit &&
+        gcCount - arena->idle_since <= arenaPoolMaxAge) {
+      kept++;
+      prev = &arena->next;
+    } else {
+      *prev = arena->next;
+      arenaPoolSize--;
+      unmapArena(arena);
+    }
+  }
+}
+
+void lockHeap();
+void unlockHeap();
+
+void gcSetArenaPool(int max_arenas, int max_age) {
+  assert(max_arenas >= 0 && max_age >= 0);
+  lockHeap();
+  arenaPoolLimit  = max_arenas;
+  arenaPoolMaxAge = max_age;
+  trimArenaPool();
+  unlockHeap();
+}
+
+// Freed large object mappings by size class, newest first. Their pages are
+// handed back to the OS but the address space is kept.
+static ArenaHeader * LargeMappingCache[NUM_LARGE_MAPPING_CLASSES];
+static size_t        largeCacheSize   = 0;
+static size_t        largeCacheLimit  = (size_t)512 << 20;
+static int           largeCacheMaxAge = 16;
+
+int cacheLargeMapping(ArenaHeader * arena) {
+  size_t size  = getRealPageSizeFromArena(arena);
+  int    class = getLargeMappingClass(size);
+  if (class < 0 || largeCacheSize + size > largeCacheLimit) return 0;
+  // The header stays, hugetlb pages can only be dropped as a whole
+  size_t keep = hugePagesEnabled ? GC_HUGE_PAGE_SIZE : sysconf(_SC_PAGESIZE);
+  if (keep < size) {
+    madvise((char*)arena + keep, size - keep, MADV_DONTNEED);
+  }
+  arena->idle_since        = gcCount;
+  arena->next              = LargeMappingCache[class];
+  LargeMappingCache[class] = arena;
+  largeCacheSize          += size;
+  return 1;
+}
+
+ArenaHeader * takeCachedMapping(size_t size) {
+  int class = getLargeMappingClass(size);
+  if (class < 0) return NULL;
+  ArenaHeader * arena = LargeMappingCache[class];
+  if (arena != NULL) {
+    LargeMappingCache[class] = arena->next;
+    largeCacheSize -= size;
+  }
+  return arena;
+}
+
+// Releases the mappings not reused for largeCacheMaxAge GCs, all of them
+// if max_age is negative
+void trimLargeMappingCache(int max_age) {
+  for (int class = 0; class < NUM_LARGE_MAPPING_CLASSES; class++) {
+    ArenaHeader ** prev = &LargeMappingCache[class];
+    while (*prev != NULL && max_age >= 0 &&
+           gcCount - (*prev)->idle_since <= max_age) {
+      prev = &(*prev)->next;
+    }
+    while (*prev != NULL) {
+      ArenaHeader * arena = *prev;
+      *prev = arena->next;
+      largeCacheSize -= getRealPageSizeFromArena(arena);
+      unmapArena(arena);
+    }
+  }
+}
+
+#ifndef MAX_LARGE_OBJECTS
+#define MAX_LARGE_OBJECTS (1 << 22)
+#endif
+
+// Address space for the slots of all classes, pages are only committed once
+// they are used
+void reserveLargeIndex() {
+  size_t slots = sizeof(ArenaHeader*) + sizeof(unsigned char);
+  char * base  = mmap(NULL, NUM_CLASSES * MAX_LARGE_OBJECTS * slots,
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (base == MAP_FAILED) {
+    fatalError("Could not reserve the large object index");
+  }
+  for (int class = 0; class < NUM_CLASSES; class++) {
+    LargeIndex * index = &LargeObjects[class];
+    index->arena = (ArenaHeader**)base + class * MAX_LARGE_OBJECTS;
+    index->epoch = (unsigned char*)(base + NUM_CLASSES * MAX_LARGE_OBJECTS *
+                                           sizeof(ArenaHeader*)) +
+                   class * MAX_LARGE_OBJECTS;
+    index->size  = 0;
+  }
+}
+
+// Requires HeapLock
+void addLargeObject(ArenaHeader * arena) {
+  LargeIndex * index = &LargeObjects[arena->gc_class];
+  if (index->size == MAX_LARGE_OBJECTS) {
+    fatalError("Too many large objects");
+  }
+  arena->large_index        = index->size;
+  index->arena[index->size] = arena;
+  index->epoch[index->size] = 0;
+  index->size++;
+}
+
+// Requires a stopped world, the last slot moves into the freed one
+void removeLargeObject(LargeIndex * index, unsigned int slot) {
+  index->size--;
+  if (slot == index->size) return;
+  ArenaHeader * moved = index->arena[index->size];
+  index->arena[slot]  = moved;
+  index->epoch[slot]  = index->epoch[index->size];
+  moved->large_index  = slot;
+}
+
+void gcSetLargeMappingCache(size_t max_bytes, int max_age) {
+  assert(max_age >= 0);
+  lockHeap();
+  largeCacheLimit  = max_bytes;
+  largeCacheMaxAge = max_age;
+  if (largeCacheSize > largeCacheLimit) trimLargeMappingCache(-1);
+  trimLargeMappingCache(largeCacheMaxAge);
+  unlockHeap();
+}
+
 ArenaHeader * allocateAlignedArena(int class, int segment) {
   ArenaHeader * chunk = NULL;
-  assert(segment < NUM_FIXED_HEAP_SEGMENTS);
+  assert(segment < NUM_ARENA_SEGMENTS);
 
-  chunk = allocateAligned(getRealPageSize(segment, -1));
+  chunk = takePooledArena();
+  if (chunk == NULL) {
+    chunk = allocateAligned(getRealPageSize(segment, -1));
+  }
   if (chunk == NULL) return NULL;
+  heapSize += getRealPageSize(segment, -1);
 
   chunk->segment            = segment;
   chunk->gc_class           = class;
+  int line_arena            = segment == LINE_SEGMENT;
+  int spans                 = line_arena ? sizeof(unsigned short) : 0;
+  chunk->object_size        = line_arena ? LINE_SIZE :
+                                           heapSegmentNodeSize(segment);
+  // The line spans are accounted as part of the lines
   int num_objects           = calcNumOfObjects(chunk,
                                                GC_ARENA_SIZE,
-                                               heapSegmentNodeSize(segment));
-  chunk->object_size        = heapSegmentNodeSize(segment);
-  chunk->object_bits        = log2(heapSegmentNodeSize(segment));
+                                               chunk->object_size + spans);
+  // Rounded up, so offset*recip>>32 is exact for every object start
+  chunk->object_recip       = (((uint64_t)1 << 32) + chunk->object_size - 1) /
+                              chunk->object_size;
 
   chunk->num_objects        = num_objects;
-  chunk->first_offset       = roundUpMemory(num_objects, arenaStartAlign);
+  // The cards follow the marks (and spans) word aligned
+  int marks                 = roundUpMemory(getMarkMapSize(num_objects) +
+                                            num_objects * spans, sizeof(long));
+  int cards                 = getNumCards(segment, -1);
+  chunk->first_offset       = roundUpMemory(marks + cards, arenaStartAlign);
+#ifdef USE_CARD_MARKING
+  chunk->cards              = (unsigned char*)getBytemap(chunk) + marks;
+  chunk->num_cards          = cards;
+#endif
 
   ObjectHeader * first      = (ObjectHeader*)getArenaFirst(chunk);
   chunk->free               = first;
   chunk->num_alloc          = 0;
 
-  chunk->free_list = allocStackChunk();
+  chunk->free_list          = NULL;
+  chunk->promoted           = 0;
+  chunk->pins               = 0;
+  chunk->evacuating         = 0;
+  if (line_arena) {
+    // A single free run
+    chunk->limit            = (void*)getArenaEnd(chunk);
+    chunk->longest_run      = num_objects;
+    getLineSpans(chunk)[0]  = num_objects;
+  }
 
   assert((uintptr_t)((char*)first +
                      (chunk->num_objects * chunk->object_size)) <=
@@ -354,20 +803,35 @@ ArenaHeader * allocateAlignedArena(int class, int segment) {
 }
 
 ArenaHeader * allocateAlignedChunk(int class, int segment, size_t object_size) {
-  assert(segment >= NUM_FIXED_HEAP_SEGMENTS);
+  assert(segment >= NUM_ARENA_SEGMENTS);
 
-  ArenaHeader * arena = allocateAligned(getRealPageSize(segment, object_size));
+  size_t        size  = getRealPageSize(segment, object_size);
+  ArenaHeader * arena = takeCachedMapping(size);
+  if (arena == NULL) {
+    arena = allocateAligned(size);
+  }
   if (arena == NULL) return NULL;
+  heapSize += size;
 
   arena->segment           = segment;
   arena->gc_class          = class;
   arena->num_objects       = 1;
   arena->num_alloc         = 1;
-  arena->first_offset      = arenaStartAlign;
+  int cards                = getNumCards(segment, object_size);
+  arena->first_offset      = roundUpMemory(getMarkMapSize(1) + cards,
+                                           arenaStartAlign);
   arena->object_size       = object_size;
+#ifdef USE_CARD_MARKING
+  arena->cards             = (unsigned char*)getBytemap(arena) +
+                             getMarkMapSize(1);
+  arena->num_cards         = cards;
+#endif
 
-  arena->object_bits       = GC_ARENA_ALIGN_BITS;
+  arena->object_recip      = 0;
   arena->free_list         = NULL;
+  arena->promoted          = 0;
+  arena->pins              = 0;
+  arena->evacuating        = 0;
 
   ObjectHeader * first     = (ObjectHeader*)getArenaFirst(arena);
   arena->free              = (void*)getArenaEnd(arena);
@@ -376,32 +840,92 @@ ArenaHeader * allocateAlignedChunk(int class, int segment, size_t object_size) {
                      (arena->num_objects * arena->object_size)) <=
          (uintptr_t)((char*)getRealPageStart(arena) +
                      getRealPageSizeFromArena(arena)));
-  assert(getMark(first) == getBytemap(arena));
+  assert(getBytemapIndex(first, arena) == 0);
 
   clearAllMarks(arena);
 
   return arena;
 }
 
+static inline ArenaHeader ** getArenaList(HeapStruct * heap, int list) {
+  return list < FREE_ARENA_BINS  ? &heap->free_arena[list] :
+         list == SWEEP_ARENA_LIST ? &heap->sweep_arena : &heap->full_arena;
+}
+
+// Snapshot of the list heads
+static inline void getArenaLists(HeapStruct * heap, ArenaHeader ** lists) {
+  for (int l = 0; l < NUM_ARENA_LISTS; l++) {
+    lists[l] = *getArenaList(heap, l);
+  }
+}
+
+static inline int getFreeArenaBin(ArenaHeader * arena) {
+  int bin = (long)arena->num_alloc * FREE_ARENA_BINS / getNumObjects(arena);
+  return bin < FREE_ARENA_BINS ? bin : FREE_ARENA_BINS - 1;
+}
+
+void pushSweepArena(ArenaHeader * arena) {
+  HeapStruct * heap = &Heap[arena->gc_class][arena->segment];
+  arena->next = heap->sweep_arena;
+  heap->sweep_arena = arena;
+}
+
+ArenaHeader * popSweepArena(int class, int segment) {
+  HeapStruct *  heap  = &Heap[class][segment];
+  ArenaHeader * arena = heap->sweep_arena;
+  if (arena != NULL) {
+    heap->sweep_arena = arena->next;
+    arena->next = NULL;
+  }
+  return arena;
+}
+
+void pushFreeArena(ArenaHeader * arena) {
+  HeapStruct * heap = &Heap[arena->gc_class][arena->segment];
+  int          bin  = getFreeArenaBin(arena);
+  arena->next = heap->free_arena[bin];
+  heap->free_arena[bin] = arena;
+}
+
+// Takes an arena of the fullest non-empty bin, else one which still has to
+// be swept
+ArenaHeader * popFreeArena(int class, int segment) {
+  HeapStruct * heap = &Heap[class][segment];
+  for (int bin = FREE_ARENA_BINS - 1; bin >= 0; bin--) {
+    ArenaHeader * arena = heap->free_arena[bin];
+    if (arena != NULL) {
+      heap->free_arena[bin] = arena->next;
+      arena->next = NULL;
+      return arena;
+    }
+  }
+  return popSweepArena(class, segment);
+}
+
 ArenaHeader * newArena(int class, int segment) {
   ArenaHeader * new_arena = allocateAlignedArena(class, segment);
   if (new_arena == NULL) return NULL;
 
-  ArenaHeader * first     = Heap[class][segment].free_arena;
-  new_arena->next = first;
-  Heap[class][segment].free_arena = new_arena;
+  pushFreeArena(new_arena);
   Heap[class][segment].object_count += new_arena->num_objects;
   return new_arena;
 }
 
 void freeArena(ArenaHeader * arena) {
   Heap[arena->gc_class][arena->segment].object_count -= arena->num_objects;
-  stackFree(arena->free_list);
-#ifdef USE_POSIX_MEMALIGN
-  free(getRealPageStart(arena));
-#else
-  munmap(getRealPageStart(arena), getRealPageSizeFromArena(arena));
-#endif
+  heapSize -= getRealPageSizeFromArena(arena);
+  if (arena->segment < NUM_ARENA_SEGMENTS &&
+      arenaPoolSize < arenaPoolLimit) {
+    arena->idle_since = gcCount;
+    arena->next       = ArenaPool;
+    ArenaPool         = arena;
+    arenaPoolSize++;
+    return;
+  }
+  if (arena->segment >= NUM_ARENA_SEGMENTS && cacheLargeMapping(arena)) {
+    return;
+  }
+  unmapArena(arena);
 }
 
 
@@ -410,63 +934,23 @@ void freeArena(ArenaHeader * arena) {
  *
  */
 
-static int  minorSinceFullGc      = FULL_GC_INTERVAL;
-static int  releaseVariableArenas = RELEASE_VARIABLE_ARENAS_INTERVAL;
-
-int isFullGcDue() {
-  return minorSinceFullGc <= 0;
-}
-
-void growHeap(int class, int segment) {
-  unsigned long grow = (double)Heap[class][segment].size_limit * heapGrowFactor + 1;
-  if (gcReportingEnabled) {
-    printf(
-      "class %d, segment %d : raising limit from %lu to %lu arenas. currently used: %lu\n",
-      class, segment, Heap[class][segment].size_limit,
-      grow, Heap[class][segment].size);
-  }
-  Heap[class][segment].size_limit = grow;
-}
-
-void tryShrinkHeap(int class, int segment) {
-  unsigned long shrink = (double)Heap[class][segment].size * heapShrinkFactor + 1;
-  if (Heap[class][segment].size_limit > shrink &&
-      (segment < NUM_FIXED_HEAP_SEGMENTS ?
-        shrink >= heapInitNumArena :
-        shrink >= heapInitNumVarArena)) {
-    if (gcReportingEnabled) {
-      printf(
-        "class %d, segment %d : shrinking limit from %lu to %lu arenas. currently used: %lu\n",
-        class, segment, Heap[class][segment].size_limit,
-        shrink, Heap[class][segment].size);
-    }
-    Heap[class][segment].size_limit = shrink;
-  }
-}
-
-int checkReleaseVariableArenas() {
-  if(releaseVariableArenas > 0) {
-    releaseVariableArenas--;
-    return 0;
-  }
-  releaseVariableArenas = RELEASE_VARIABLE_ARENAS_INTERVAL;
-  return 1;
-}
-
 int  isArenaConsideredFull(ArenaHeader * arena) {
   float population = (float)arena->num_alloc /
                      (float)getNumObjects(arena);
   return population >= arenaFullPercentage;
 }
 
+// Worth sweeping if the marking found enough dead objects in the arena
 int  isSweepingCandidate(ArenaHeader * arena) {
-  float population = (float)arena->num_alloc /
-                     (float)getNumObjects(arena);
-  return arena->segment >= NUM_FIXED_HEAP_SEGMENTS ||
-         (!arena->was_full && population > arenaEmptyPercentage);
+  int   live    = getLiveCount(arena);
+  float garbage = (float)(arena->num_alloc - (live < arena->num_alloc ?
+                                              live : arena->num_alloc)) /
+                  (float)getNumObjects(arena);
+  return garbage > arenaGarbagePercentage;
 }
 
 void sweepingDone(ArenaHeader * arena){
+  arena->needs_sweep = 0;
   if (isArenaConsideredFull(arena)) {
     arena->was_full = 1;
   }
@@ -499,12 +983,136 @@ void updateMaxClass(int full_gc) {
 }
 
 
+/*
+ * Pacer
+ *
+ * GCs are scheduled for the heap as a whole: one runs when an allocation
+ * needs another arena and the arenas would outgrow heapGoal. After a full GC
+ * the goal is the live size plus heapGrowth percent (like GOGC), or the
+ * fixed heapTarget. Partial GCs cannot reclaim what survived into the old
+ * class, so once the survival rate predicts that the next partial GC would
+ * leave less than minPartialRunway of the goal, the next GC is full.
+ *
+ */
+
+static int    heapGrowth       = 75;
+static size_t heapTarget       = 0;
+static size_t heapGoal         = MIN_HEAP_GOAL;
+// Bytes of objects which survived the last GC. Lazy sweeping lowers it when
+// it finds the garbage.
+static size_t heapSurvivors    = 0;
+// Bytes handed to the allocator since the last GC
+static size_t allocatedSinceGc = 0;
+
+static int    lastGcFull       = 0;
+static size_t lastSurvivors    = 0;
+static size_t lastAllocated    = 0;
+static double allocationRate   = 0;  // bytes per second
+static double survivalRate     = 0;  // of the bytes allocated between GCs
+static double lastMarkSeconds  = 0;  // of the last full GC
+static struct timespec lastGcEnd;
+
+double secondsSince(struct timespec * t) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - t->tv_sec) + (now.tv_nsec - t->tv_nsec) / 1e9;
+}
+
+size_t pacerGoalFor(size_t live) {
+  size_t goal = live + (size_t)((double)live * heapGrowth / 100);
+  // The target only applies while it leaves partial GCs enough room,
+  // otherwise every GC would be a full one
+  if (heapTarget > 0 && live < heapTarget * (1 - 2 * minPartialRunway)) {
+    goal = heapTarget;
+  }
+  return goal < MIN_HEAP_GOAL ? MIN_HEAP_GOAL : goal;
+}
+
+// Requires HeapLock
+int pacerAllowsArena(size_t bytes) {
+  if (lastGcFull) {
+    // Survivors of lazily swept full GCs are only known by now
+    heapGoal = pacerGoalFor(heapSurvivors);
+  }
+  return heapSize + bytes <= heapGoal;
+}
+
+// Requires HeapLock
+int pacerFullGcDue() {
+  size_t runway = heapGoal > heapSurvivors ? heapGoal - heapSurvivors : 0;
+  // The survivors of the next partial GC will eat into the runway
+  return (1 - survivalRate) * runway < minPartialRunway * heapGoal;
+}
+
+// Requires HeapLock. Concurrent marking has to start early enough to finish
+// before the mutator allocated up to the goal.
+int pacerMarkDeadlineNear() {
+  size_t used = heapSurvivors + allocatedSinceGc;
+  size_t left = heapGoal > used ? heapGoal - used : 0;
+  return left <= allocationRate * lastMarkSeconds;
+}
+
+// Requires a stopped world
+void pacerStartCycle() {
+  double mutator = secondsSince(&lastGcEnd);
+  if (mutator > 0 && allocatedSinceGc > 0) {
+    allocationRate = (1 - pacerSmoothing) * allocationRate +
+                     pacerSmoothing * allocatedSinceGc / mutator;
+  }
+  // By now lazy sweeping found most garbage the last GC left behind. After
+  // a full GC the survivors shrink, which counts as no survival and gives
+  // partial GCs another chance.
+  if (lastAllocated > 0) {
+    double survived = heapSurvivors > lastSurvivors ?
+      (double)(heapSurvivors - lastSurvivors) / lastAllocated : 0;
+    if (survived > 1) survived = 1;
+    survivalRate = (1 - pacerSmoothing) * survivalRate +
+                   pacerSmoothing * survived;
+  }
+  lastSurvivors = heapSurvivors;
+  lastAllocated = allocatedSinceGc;
+}
+
+size_t heapUsedBytes();
+
+// Requires a stopped world
+void pacerEndCycle(int full_gc, double mark_seconds) {
+  heapSurvivors    = heapUsedBytes();
+  allocatedSinceGc = 0;
+  lastGcFull       = full_gc;
+  if (full_gc) {
+    heapGoal        = pacerGoalFor(heapSurvivors);
+    lastMarkSeconds = mark_seconds;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &lastGcEnd);
+}
+
+void gcSetHeapGrowth(int percent) {
+  assert(percent > 0);
+  lockHeap();
+  heapGrowth = percent;
+  heapGoal   = pacerGoalFor(heapSurvivors);
+  unlockHeap();
+}
+
+void gcSetHeapTarget(size_t bytes) {
+  lockHeap();
+  heapTarget = bytes;
+  heapGoal   = pacerGoalFor(heapSurvivors);
+  unlockHeap();
+}
+
+
 /*
  * Object access
  *
  */
 
 extern inline void gcWriteBarrier(ObjectHeader * parent, ObjectHeader * child);
+extern inline void gcWriteBarrierSlot(ObjectHeader * parent, void * slot);
+#ifdef USE_CARD_MARKING
+extern inline unsigned char * getCard(ArenaHeader * arena, void * ptr);
+#endif
 
 
 /*
@@ -516,8 +1124,9 @@ void verifyHeap();
 void doGc(int full, int segment);
 
 ObjectHeader * allocFromArena(ArenaHeader * arena) {
-  if (!stackEmpty(arena->free_list)) {
-    ObjectHeader * o = stackPop(&arena->free_list);
+  if (arena->free_list != NULL) {
+    ObjectHeader * o = arena->free_list;
+    arena->free_list = *(ObjectHeader**)o;
     arena->num_alloc++;
     return o;
   }
@@ -531,57 +1140,167 @@ ObjectHeader * allocFromArena(ArenaHeader * arena) {
   return NULL;
 }
 
+// Moves on to the shortest free line run of the arena long enough for the
+// object (best fit), which keeps the long runs for the largest objects. What
+// is left of the current run is kept for smaller objects.
+int takeFreeLines(ArenaHeader * arena, int lines) {
+  unsigned short * spans   = getLineSpans(arena);
+  ObjectHeader **  best    = NULL;
+  int              fit     = 0;
+  int              longest = (arena->limit - arena->free) >> LINE_SIZE_BITS;
+  for (ObjectHeader ** prev = &arena->free_list;
+       *prev != NULL;
+       prev = (ObjectHeader**)*prev) {
+    int span = spans[getLineIndex(*prev, arena)];
+    assert(span <= arena->longest_run);
+    if (span > longest) longest = span;
+    if (span >= lines && (best == NULL || span < fit)) {
+      best = prev;
+      fit  = span;
+      if (span == lines) break;
+    }
+  }
+  if (best == NULL) {
+    // All runs were seen, the arena is skipped for objects this long
+    arena->longest_run = longest;
+    return 0;
+  }
+  ObjectHeader * run = *best;
+  *best = *(ObjectHeader**)run;
+
+  if (arena->limit - arena->free >= MIN_LINE_RUN * LINE_SIZE) {
+    *(ObjectHeader**)arena->free = arena->free_list;
+    arena->free_list = arena->free;
+  }
+  arena->free  = run;
+  arena->limit = (char*)run + ((size_t)fit << LINE_SIZE_BITS);
+  return 1;
+}
+
+// Bump pointer allocation in the current free line run. The span of the
+// rest of the run is kept up to date, thus the arena can always be walked.
+ObjectHeader * allocFromLines(ArenaHeader * arena, size_t size) {
+  int    lines = (size + LINE_SIZE - 1) >> LINE_SIZE_BITS;
+  size_t bytes = (size_t)lines << LINE_SIZE_BITS;
+  if (arena->free + bytes > arena->limit && !takeFreeLines(arena, lines)) {
+    return NULL;
+  }
+  ObjectHeader *   o     = arena->free;
+  unsigned short * spans = getLineSpans(arena);
+  int              line  = getLineIndex(o, arena);
+  spans[line] = lines;
+  arena->free = arena->free + bytes;
+  if (arena->free < arena->limit) {
+    spans[line + lines] = (arena->limit - arena->free) >> LINE_SIZE_BITS;
+  }
+  arena->num_alloc += lines;
+  return o;
+}
+
+static inline ObjectHeader * allocInArena(ArenaHeader * arena, size_t size) {
+  if (arena->segment == LINE_SEGMENT) return allocFromLines(arena, size);
+  return allocFromArena(arena);
+}
+
+// Thread local, no synchronization needed
 static inline ObjectHeader * tryFastAllocFromSegment(int class,
-                                              int segment) {
-  ArenaHeader * arena = Heap[class][segment].free_arena;
+                                                     int segment,
+                                                     size_t size) {
+  ArenaHeader * arena = LocalThread.arena[class][segment];
   if (arena == NULL) return NULL;
-  return allocFromArena(arena);
+  return allocInArena(arena, size);
+}
+
+int lazySweepArena(ArenaHeader * arena);
+
+// Requires HeapLock. Takes back the cells claimed with a thread's arena which
+// were not allocated after all.
+void unclaimArena(ArenaHeader * arena) {
+  size_t unused = (size_t)(arena->num_objects - arena->num_alloc) *
+                  getObjectSize(arena);
+  allocatedSinceGc -= unused < allocatedSinceGc ? unused : allocatedSinceGc;
+  Heap[arena->gc_class][arena->segment].used_bytes -= unused;
 }
 
-ObjectHeader * allocFromFixedSegment(int class,
+// Requires HeapLock
+ObjectHeader * allocFromArenaSegment(int class,
                                      int segment,
+                                     size_t size,
                                      int new_arena) {
-  assert(segment < NUM_FIXED_HEAP_SEGMENTS);
-  ArenaHeader * arena = Heap[class][segment].free_arena;
+  assert(segment < NUM_ARENA_SEGMENTS);
+  ArenaHeader *  arena    = LocalThread.arena[class][segment];
+  ObjectHeader * o        = NULL;
+  // Line arenas without a run long enough for this object, which go back
+  // to the free bins once the search is over
+  ArenaHeader *  rejected = NULL;
+  unsigned int   lines    = (size + LINE_SIZE - 1) >> LINE_SIZE_BITS;
   while (1) {
-    if (arena == NULL) {
-      if (new_arena == 1) {
-        arena = newArena(class, segment);
-        if (arena != NULL) {
-          Heap[class][segment].size++;
-        }
+    if (arena != NULL) {
+      assert(arena->gc_class == class);
+      assert(arena->segment == segment);
+
+      o = allocInArena(arena, size);
+      if (o != NULL) {
+        assert(chunkFromPtr(o) == arena);
+        break;
+      }
+
+      LocalThread.arena[class][segment] = NULL;
+      unclaimArena(arena);
+      if (segment == LINE_SEGMENT && !isArenaConsideredFull(arena)) {
+        arena->next = rejected;
+        rejected    = arena;
       } else {
-        return NULL;
+        // This arena is full. Hand it back to full_arena to not have to
+        // search it again
+        arena->next = Heap[class][segment].full_arena;
+        Heap[class][segment].full_arena = arena;
       }
     }
 
-    assert(arena->gc_class == class);
-    assert(arena->segment == segment);
-
-    ObjectHeader * o = allocFromArena(arena);
-    if (o != NULL) {
-      assert(chunkFromPtr(o) == arena);
-
-      return o;
+    // Claim the next free arena for this thread
+    arena = popFreeArena(class, segment);
+    if (arena == NULL) {
+      if (new_arena != 1 || newArena(class, segment) == NULL) {
+        break;
+      }
+      Heap[class][segment].size++;
+      arena = popFreeArena(class, segment);
     }
 
-    // This arena is full. Move to full_arena to not have to search it again
-    ArenaHeader * next = arena->next;
-
-    ArenaHeader * full = Heap[class][segment].full_arena;
-    arena->next = full;
-    Heap[class][segment].full_arena = arena;
+    // While marking concurrently the marks are not valid yet, the arena's
+    // current free list is used until the sweep after the remark
+    if (arena->needs_sweep && !gcMarkingActive && !lazySweepArena(arena)) {
+      arena = NULL;
+      continue;
+    }
+    if (segment == LINE_SEGMENT && arena->longest_run < lines) {
+      // Not claimed, its free runs are not searched
+      arena->next = rejected;
+      rejected    = arena;
+      arena       = NULL;
+      continue;
+    }
+    LocalThread.arena[class][segment] = arena;
+    size_t claimed = (size_t)(arena->num_objects - arena->num_alloc) *
+                     getObjectSize(arena);
+    allocatedSinceGc += claimed;
+    Heap[class][segment].used_bytes += claimed;
+  }
 
-    Heap[class][segment].free_arena = next;
-    arena = next;
+  while (rejected != NULL) {
+    arena    = rejected;
+    rejected = arena->next;
+    pushFreeArena(arena);
   }
+  return o;
 }
 
 ObjectHeader * allocFromVariableSegment(int class,
                                         int segment,
                                         size_t size,
                                         int new_arena) {
-  assert(segment >= NUM_FIXED_HEAP_SEGMENTS);
+  assert(segment >= NUM_ARENA_SEGMENTS);
 
   if (!new_arena) {
     return NULL;
@@ -595,7 +1314,12 @@ ObjectHeader * allocFromVariableSegment(int class,
   Heap[class][segment].size++;
   ArenaHeader * first = Heap[class][segment].full_arena;
   arena->next = first;
+  arena->prev = NULL;
+  if (first != NULL) first->prev = arena;
   Heap[class][segment].full_arena = arena;
+  Heap[class][segment].used_bytes += size;
+  addLargeObject(arena);
+  allocatedSinceGc += size;
 
   return (ObjectHeader*)getArenaFirst(arena);
 }
@@ -604,44 +1328,64 @@ ObjectHeader * allocFromSegment(int class,
                                 int segment,
                                 size_t size,
                                 int grow) {
-  return (segment < NUM_FIXED_HEAP_SEGMENTS) ?
-    allocFromFixedSegment(class, segment, grow) :
+  return (segment < NUM_ARENA_SEGMENTS) ?
+    allocFromArenaSegment(class, segment, size, grow) :
     allocFromVariableSegment(class, segment, size, grow);
 }
 
-ObjectHeader * gcAllocDeferred(size_t size, int class, int segment) {
-  int grow = Heap[class][segment].size < Heap[class][segment].size_limit;
-  ObjectHeader * o = allocFromSegment(class, segment, size, grow);
-
-  if (o == NULL) {
-    int full_gc = isFullGcDue();
+void lockHeap();
+void unlockHeap();
 
-    float used_space_before = (float)Heap[class][segment].alloc_count /
-                              (float)Heap[class][segment].object_count;
+int  concurrentMarkFinished();
+void startConcurrentMark();
+int  incrementalMarkStep();
 
-    // No free space, do gc
-    doGc(full_gc, segment);
-    if (full_gc) minorSinceFullGc = FULL_GC_INTERVAL;
+ObjectHeader * gcAllocDeferred(size_t size, int class, int segment) {
+  lockHeap();
+
+  int remark = gcMarkingActive &&
+    (concurrentMarkingEnabled ? concurrentMarkFinished()
+                              : !incrementalMarkStep());
+  if (remark) {
+    // Final remark pause of the concurrent or incremental cycle
+    doGc(1, segment);
+  }
 
-    float used_space_after  = (float)Heap[class][segment].alloc_count /
-                              (float)Heap[class][segment].object_count;
+  size_t bytes = getRealPageSize(segment, size);
+  // Every thread may claim an arena of each segment. Otherwise threads
+  // sharing the only arena of a segment would collect in turns to pass it
+  // on, whatever the heap goal.
+  int    grow  = segment < NUM_ARENA_SEGMENTS &&
+                 Heap[class][segment].size < numThreads;
+  ObjectHeader * o = allocFromSegment(class, segment, size,
+                                      grow || pacerAllowsArena(bytes));
+
+  if (concurrentMarkingEnabled && !gcMarkingActive && pacerFullGcDue() &&
+      (o == NULL || pacerMarkDeadlineNear())) {
+    startConcurrentMark();
+  }
 
+  // Incremental cycles start at the goal and mark while the heap grows past
+  // it, but not right after the remark of the last one
+  if (incrementalMarkingEnabled && !concurrentMarkingEnabled &&
+      !gcMarkingActive && !remark && o == NULL && pacerFullGcDue()) {
+    startConcurrentMark();
+  }
 
-    if (used_space_before - used_space_after < minFreedSpaceLimit ||
-        used_space_after > maxUsedSpaceLimit) {
-      if (full_gc) {
-        growHeap(class, segment);
-      } else {
-        minorSinceFullGc--;
-      }
-    }
+  if (o == NULL && (gcMarkingActive || remark)) {
+    // Keep allocating (black) in new arenas while the collector is marking,
+    // the remark just collected
+    o = allocFromSegment(class, segment, size, 1);
+  }
 
-    int grow = Heap[class][segment].size < Heap[class][segment].size_limit;
-    o = allocFromSegment(class, segment, size, grow);
+  if (o == NULL) {
+    // No free space, do gc
+    doGc(pacerFullGcDue(), segment);
 
+    o = allocFromSegment(class, segment, size,
+                         grow || pacerAllowsArena(bytes));
     if (o == NULL) {
-      // Still no free space, grow heap
-      growHeap(class, segment);
+      // The goal is not a hard limit, rather grow than collect again
       o = allocFromSegment(class, segment, size, 1);
     }
   }
@@ -650,15 +1394,29 @@ ObjectHeader * gcAllocDeferred(size_t size, int class, int segment) {
     fatalError("Out of memory");
   }
 
+  unlockHeap();
   return o;
 }
 
 double alloc_avg[NUM_HEAP_SEGMENTS];
 unsigned long long alloc_cnt[NUM_HEAP_SEGMENTS];
 
+// Requires HeapLock or a stopped world
+void mergeAllocStats(ThreadContext * thread) {
+  for (int i = 0; i < NUM_HEAP_SEGMENTS; i++) {
+    if (thread->alloc_count[i] == 0) continue;
+    alloc_avg[i] = (alloc_avg[i] * alloc_cnt[i] + thread->alloc_fill[i]) /
+                   (alloc_cnt[i] + thread->alloc_count[i]);
+    alloc_cnt[i] += thread->alloc_count[i];
+    thread->alloc_fill[i]  = 0;
+    thread->alloc_count[i] = 0;
+  }
+}
+
 ObjectHeader * gcAlloc(size_t size, int class) {
   assert(size >= 0);
   assert(class >= 0 && class < NUM_CLASSES);
+  assert(LocalThread.registered);
 
   int segment = getFixedSegmentForSize(size);
 
@@ -672,19 +1430,28 @@ ObjectHeader * gcAlloc(size_t size, int class) {
          (heapSegmentNodeSize(segment) >= size));
 
   if (gcReportingEnabled) {
-    double a = (float)size/(float)heapSegmentNodeSize(segment);
-    alloc_avg[segment] = ((alloc_avg[segment] * alloc_cnt[segment]) + a);
-    alloc_cnt[segment]++;
-    alloc_avg[segment] /= alloc_cnt[segment];
+    double a = (float)size/(float)(segment < NUM_FIXED_HEAP_SEGMENTS ?
+                                   heapSegmentNodeSize(segment) :
+                                   roundUpMemory(size, LINE_SIZE));
+    LocalThread.alloc_fill[segment] += a;
+    LocalThread.alloc_count[segment]++;
   }
 
-  if (segment < NUM_FIXED_HEAP_SEGMENTS) {
-    ObjectHeader * o = tryFastAllocFromSegment(class, segment);
-    if (o != NULL) return o;
+  ObjectHeader * o = NULL;
+  if (segment < NUM_ARENA_SEGMENTS) {
+    o = tryFastAllocFromSegment(class, segment, size);
+  }
+  if (o == NULL) {
+    o = gcAllocDeferred(size, class, segment);
   }
 
-  return gcAllocDeferred(size, class, segment);
-}
+  // Objects allocated during concurrent marking are live
+  if (gcMarkingActive) {
+    countLiveObject(o, 1);
+    setMarkBlack(o);
+  }
+  return o;
+}
 
 
 /*
@@ -700,363 +1467,2008 @@ extern inline int stackEmpty(StackChunk * stack);
 extern inline void stackPush(StackChunk ** stack_, ObjectHeader * o);
 extern inline ObjectHeader * stackPop(StackChunk ** stack_);
 
+static int gcCollecting   = 0;
+static int gcDeferMarking = 0;
+
+int gcMarkingActive = 0;
+
+// Grey and black are 2 * epoch and 2 * epoch + 1, which have to fit a char
+#ifndef MAX_MARK_EPOCH
+#define MAX_MARK_EPOCH 127
+#endif
+
+unsigned char gcMarkEpoch = 1;
+
+static int          evacuationRequested = 0;
+static StackChunk * RootPins;
+
+int tryMarkGrey(void * ptr);
+
 void gcForward(ObjectHeader * object) {
-  stackPush(&MarkStack, object);
-  *getMark(object) = GREY_MARK;
+  if (gcCollecting && evacuationRequested) {
+    // Root slots cannot be updated, thus roots do not move
+    chunkFromPtr(object)->pins++;
+    stackPush(&RootPins, object);
+  }
+  // Outside of a GC several mutators might forward objects at the same time
+  stackPush(gcCollecting ? &MarkStack : &LocalThread.mark_buffer, object);
+  // A marked object is re-greyed, it was counted when it turned from white
+  if (!tryMarkGrey(object)) setMarkGrey(object);
+}
+
+// Without grey marks every object popped from a mark stack is scanned
+int needsScanning(ObjectHeader * object) {
+#ifndef USE_MARK_BITMAP
+  return !isMarkBlack(object);
+#else
+  return 1;
+#endif
 }
 
-#define _FORWARD_CHILD_IF_UNMARKED(child, _) \
-  if (child != NULL && *getMark(child) == WHITE_MARK) { \
-    stackPush(&MarkStack, child); \
-    *getMark(child) = GREY_MARK; \
+// Only safe while no other thread sets marks
+void setMarkGreyUnsynchronized(void * ptr) {
+#ifndef USE_MARK_BITMAP
+  setMarkGrey(ptr);
+#else
+  *getMarkWord(ptr) |= getMarkBit(ptr);
+#endif
+}
+
+// Concurrently, whoever turns the mark from white counts and pushes the child
+#define _FORWARD_CHILD_IF_UNMARKED(child, concurrent) \
+  if (child != NULL && isMarkWhite(child)) { \
+    if (!(concurrent)) { \
+      stackPush(&MarkStack, child); \
+      countLiveObject(child, 0); \
+      setMarkGreyUnsynchronized(child); \
+    } else if (tryMarkGrey(child)) { \
+      stackPush(&MarkStack, child); \
+    } \
   }
 
 #define _ASSERT_CHILD_MARKED(child, _) \
-  assert(child == NULL || *getMark(child) != WHITE_MARK)
+  assert(child == NULL || !isMarkWhite(child))
 
-void gcMark() {
+void gcParallelMark();
+
+// Drains MarkStack until it is empty or *stop is set
+void drainMarkStack(int * stop) {
   while(!stackEmpty(MarkStack)) {
+    if (stop != NULL && __atomic_load_n(stop, __ATOMIC_RELAXED)) {
+      return;
+    }
     ObjectHeader * cur = stackPop(&MarkStack);
-    char * mark        = getMark(cur);
 #ifdef DEBUG
-    assert(*mark != WHITE_MARK);
-    if (*mark == BLACK_MARK) {
+    assert(!isMarkWhite(cur));
+#ifndef USE_MARK_BITMAP
+    assert((uintptr_t)getMark(cur) < getArenaFirst(chunkFromPtr(cur)));
+    // Concurrently running mutators might have re-greyed the object
+    if (isMarkBlack(cur) && stop == NULL) {
       DO_CHILDREN(cur, _ASSERT_CHILD_MARKED, NULL);
     }
 #endif
-    if (*mark != BLACK_MARK) {
-      DO_CHILDREN(cur, _FORWARD_CHILD_IF_UNMARKED, NULL);
-      assert((uintptr_t)mark < getArenaFirst(chunkFromPtr(cur)));
-      *mark = BLACK_MARK;
+#endif
+    if (needsScanning(cur)) {
+      DO_CHILDREN(cur, _FORWARD_CHILD_IF_UNMARKED, stop != NULL);
+      setMarkBlack(cur);
     }
   }
 }
 
-void sweepArena(ArenaHeader * arena) {
-  if (arena->segment >= NUM_FIXED_HEAP_SEGMENTS) {
-    assert(getNumObjects(arena) == 1);
-    assert(arena->num_alloc == 1);
+#ifdef USE_MARK_PREFETCH
+
+// Grey objects wait this many scans in a FIFO for their prefetches
+#define MARK_PREFETCH_DISTANCE 8
+
+static inline void prefetchForScanning(ObjectHeader * o) {
+  __builtin_prefetch(o);
+#ifndef USE_MARK_BITMAP
+  __builtin_prefetch(getMark(o));
+#else
+  __builtin_prefetch(getMarkWord(o));
+#endif
+}
+
+// Same as drainMarkStack(NULL)
+void drainMarkStackPrefetching() {
+  ObjectHeader * fifo[MARK_PREFETCH_DISTANCE];
+  int head  = 0;
+  int count = 0;
+  while (1) {
+    while (count < MARK_PREFETCH_DISTANCE && !stackEmpty(MarkStack)) {
+      ObjectHeader * o = stackPop(&MarkStack);
+      prefetchForScanning(o);
+      fifo[(head + count) % MARK_PREFETCH_DISTANCE] = o;
+      count++;
+    }
+    if (count == 0) {
+      return;
+    }
+    ObjectHeader * cur = fifo[head];
+    head = (head + 1) % MARK_PREFETCH_DISTANCE;
+    count--;
+    assert(!isMarkWhite(cur));
+    if (needsScanning(cur)) {
+      DO_CHILDREN(cur, _FORWARD_CHILD_IF_UNMARKED, 0);
+      setMarkBlack(cur);
+    }
+  }
+}
+
+#endif
+
+void gcMark() {
+  if (gcDeferMarking) {
+    // Initial pause of a concurrent cycle, roots are traced in background
+    return;
+  }
+  if (markThreads > 1) {
+    gcParallelMark();
+    return;
+  }
+#ifdef USE_MARK_PREFETCH
+  drainMarkStackPrefetching();
+#else
+  drainMarkStack(NULL);
+#endif
+}
+
+extern inline void dequeInit(MarkDeque * deque);
+extern inline int dequeEmpty(MarkDeque * deque);
+extern inline int dequePush(MarkDeque * deque, ObjectHeader * o);
+extern inline ObjectHeader * dequePop(MarkDeque * deque);
+extern inline ObjectHeader * dequeSteal(MarkDeque * deque);
+
+void markWorkerPush(MarkWorker * worker, ObjectHeader * o) {
+  if (!dequePush(&worker->deque, o)) {
+    stackPush(&worker->overflow, o);
+  }
+}
+
+ObjectHeader * markWorkerPop(MarkWorker * worker) {
+  while (1) {
+    ObjectHeader * o = dequePop(&worker->deque);
+    if (o != NULL) return o;
+    if (stackEmpty(worker->overflow)) return NULL;
+    // Move spilled entries back to the deque to make them stealable
+    for (int i = 0; i < MarkDequeSize / 2 && !stackEmpty(worker->overflow);
+         i++) {
+      dequePush(&worker->deque, stackPop(&worker->overflow));
+    }
+  }
+}
+
+ObjectHeader * markWorkerSteal(int id) {
+  for (int i = 1; i < markThreads; i++) {
+    MarkDeque * victim = &MarkWorkers[(id + i) % markThreads]->deque;
+    ObjectHeader * o;
+    do {
+      o = dequeSteal(victim);
+    } while (o == DEQUE_ABORT);
+    if (o != NULL) return o;
   }
-  if (getArenaEnd(arena) > (uintptr_t)arena->free) {
+  return NULL;
+}
+
+int markWorkAvailable() {
+  for (int i = 0; i < markThreads; i++) {
+    if (!dequeEmpty(&MarkWorkers[i]->deque)) return 1;
+  }
+  return 0;
+}
+
+// Returns 1 if this thread turned the mark from white to grey and counted it
+int tryMarkGrey(void * ptr) {
+#ifndef USE_MARK_BITMAP
+  // White is any mark of an older epoch
+  char mark = __atomic_load_n(getMark(ptr), __ATOMIC_RELAXED);
+  while (isWhiteMark(mark)) {
+    if (__atomic_compare_exchange_n(getMark(ptr), &mark, GREY_MARK, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      countLiveObject(ptr, 1);
+      return 1;
+    }
+  }
+  return 0;
+#else
+  MarkWord bit = getMarkBit(ptr);
+  if (__atomic_fetch_or(getMarkWord(ptr), bit, __ATOMIC_RELAXED) & bit) {
+    return 0;
+  }
+  countLiveObject(ptr, 1);
+  return 1;
+#endif
+}
+
+// Only the thread winning the race from white to grey pushes the child
+#define _PARALLEL_FORWARD_CHILD_IF_UNMARKED(child, worker) \
+  if (child != NULL && isMarkWhite(child) && tryMarkGrey(child)) { \
+    markWorkerPush(worker, child); \
+  }
+
+static int idleMarkWorkers;
+
+void markWorker(int id) {
+  MarkWorker * worker = MarkWorkers[id];
+  while (1) {
+    ObjectHeader * cur;
+    while ((cur = markWorkerPop(worker)) != NULL) {
+      assert(!isMarkWhite(cur));
+      if (needsScanning(cur)) {
+        DO_CHILDREN(cur, _PARALLEL_FORWARD_CHILD_IF_UNMARKED, worker);
+        setMarkBlack(cur);
+      }
+    }
+
+    cur = markWorkerSteal(id);
+    if (cur != NULL) {
+      markWorkerPush(worker, cur);
+      continue;
+    }
+
+    // Only busy workers create work, thus we are done once all are idle
+    __atomic_add_fetch(&idleMarkWorkers, 1, __ATOMIC_SEQ_CST);
+    while (1) {
+      if (__atomic_load_n(&idleMarkWorkers, __ATOMIC_SEQ_CST) == markThreads) {
+        return;
+      }
+      if (markWorkAvailable()) {
+        __atomic_sub_fetch(&idleMarkWorkers, 1, __ATOMIC_SEQ_CST);
+        break;
+      }
+      sched_yield();
+    }
+  }
+}
+
+void runOnWorkers(void (*task)(int), int num);
+
+void gcParallelMark() {
+  // Distribute the roots
+  int i = 0;
+  ObjectHeader * o;
+  while ((o = stackPop(&MarkStack)) != NULL) {
+    markWorkerPush(MarkWorkers[i], o);
+    i = (i + 1) % markThreads;
+  }
+  idleMarkWorkers = 0;
+  runOnWorkers(markWorker, markThreads);
+  for (i = 0; i < markThreads; i++) {
+    assert(dequeEmpty(&MarkWorkers[i]->deque));
+    assert(stackEmpty(MarkWorkers[i]->overflow));
+  }
+}
+
+void zapObject(ObjectHeader * o, ArenaHeader * arena) {
+#ifdef DEBUG
+  long * f = (long*)o;
+  for (int i = 0; i < getObjectSize(arena) / sizeof(long); i++) {
+    *f = kGcZapPointer;
+    f++;
+  }
+#endif
+}
+
+// The free list is threaded through the first word of the dead objects
+static inline void pushFreeObject(ArenaHeader * arena, ObjectHeader * o) {
+  zapObject(o, arena);
+  *(ObjectHeader**)o = arena->free_list;
+  arena->free_list   = o;
+}
+
+
+/*
+ * Sweep kernels
+ *
+ * Push the white objects among the first num of a bytemap onto the free list
+ * and return their number.
+ *
+ */
+
+int sweepBytemapRange(ArenaHeader * arena, int from, int to) {
+  char * mark           = &getBytemap(arena)[from];
+  char * end            = &getBytemap(arena)[to];
+  ObjectHeader * finger = (ObjectHeader*)(getArenaFirst(arena) +
+                                          from * getObjectSize(arena));
+  int dead = 0;
+
+  while (mark < end) {
+#ifndef USE_MARK_BITMAP
+    assert(getMark(finger) == mark);
+#endif
+    assert((uintptr_t)mark < getArenaFirst(arena));
+    assert((void*)mark >= (void*)(arena+1));
+    // Swept lazily the write barrier might have re-greyed live objects
+    assert(*mark != GREY_MARK || lazySweepingEnabled);
+
+    if (isWhiteMark(*mark)) {
+      dead++;
+      pushFreeObject(arena, finger);
+    } else {
+      assert(*mark == BLACK_MARK || lazySweepingEnabled);
+    }
+    nextObject(&finger, arena);
+    mark++;
+  }
+  return dead;
+}
+
+int sweepBytemapScalar(ArenaHeader * arena, int num) {
+  return sweepBytemapRange(arena, 0, num);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// dead has one bit per object of a group of 32 objects
+static inline void pushDeadObjects(ArenaHeader * arena,
+                                   uint32_t dead,
+                                   char * group) {
+  size_t size = getObjectSize(arena);
+  if (dead == 0xFFFFFFFF) {
+    for (int i = 0; i < 32; i++) {
+      pushFreeObject(arena, (ObjectHeader*)(group + i * size));
+    }
     return;
   }
+  while (dead != 0) {
+    int bit = __builtin_ctz(dead);
+    pushFreeObject(arena, (ObjectHeader*)(group + bit * size));
+    dead &= dead - 1;
+  }
+}
+
+__attribute__((target("sse2,popcnt")))
+int sweepBytemapSSE2(ArenaHeader * arena, int num) {
+  char *  mark  = getBytemap(arena);
+  char *  first = (char*)getArenaFirst(arena);
+  int     dead  = 0;
+  // Live objects are black or grey of the current epoch, all other marks
+  // are white
+  __m128i grey  = _mm_set1_epi8(1);
+  __m128i black = _mm_set1_epi8(BLACK_MARK);
+
+  int i = 0;
+  for (; i + 32 <= num; i += 32) {
+    __m128i lo = _mm_or_si128(_mm_loadu_si128((__m128i*)(mark + i)), grey);
+    __m128i hi = _mm_or_si128(_mm_loadu_si128((__m128i*)(mark + i + 16)), grey);
+    uint32_t group = ~((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(lo, black)) |
+                       ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(hi, black)) << 16));
+    if (group == 0) continue;
+    dead += __builtin_popcount(group);
+    pushDeadObjects(arena, group, first + i * getObjectSize(arena));
+  }
+  return dead + sweepBytemapRange(arena, i, num);
+}
+
+__attribute__((target("avx2,popcnt")))
+int sweepBytemapAVX2(ArenaHeader * arena, int num) {
+  char *  mark  = getBytemap(arena);
+  char *  first = (char*)getArenaFirst(arena);
+  int     dead  = 0;
+  __m256i grey  = _mm256_set1_epi8(1);
+  __m256i black = _mm256_set1_epi8(BLACK_MARK);
+
+  int i = 0;
+  for (; i + 64 <= num; i += 64) {
+    __m256i lo = _mm256_or_si256(_mm256_loadu_si256((__m256i*)(mark + i)), grey);
+    __m256i hi = _mm256_or_si256(_mm256_loadu_si256((__m256i*)(mark + i + 32)), grey);
+    uint32_t dead_lo = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, black));
+    uint32_t dead_hi = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, black));
+    // Skip fully live groups of 64 objects with a single test
+    if ((dead_lo | dead_hi) == 0) continue;
+    dead += __builtin_popcountll(((uint64_t)dead_hi << 32) | dead_lo);
+    if (dead_lo != 0) {
+      pushDeadObjects(arena, dead_lo, first + i * getObjectSize(arena));
+    }
+    if (dead_hi != 0) {
+      pushDeadObjects(arena, dead_hi, first + (i + 32) * getObjectSize(arena));
+    }
+  }
+  return dead + sweepBytemapRange(arena, i, num);
+}
+
+#endif
+
+static int (*sweepBytemap)(ArenaHeader * arena, int num) = sweepBytemapScalar;
+
+int gcSetSweepKernel(int kernel) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  int sse2 = __builtin_cpu_supports("sse2") && __builtin_cpu_supports("popcnt");
+  int avx2 = sse2 && __builtin_cpu_supports("avx2");
+  if (kernel == GC_SWEEP_AUTO) {
+    kernel = avx2 ? GC_SWEEP_AVX2 : (sse2 ? GC_SWEEP_SSE2 : GC_SWEEP_SCALAR);
+  }
+  if ((kernel == GC_SWEEP_SSE2 && !sse2) || (kernel == GC_SWEEP_AVX2 && !avx2)) {
+    return 0;
+  }
+  sweepBytemap = kernel == GC_SWEEP_AVX2 ? sweepBytemapAVX2 :
+                 kernel == GC_SWEEP_SSE2 ? sweepBytemapSSE2 :
+                                           sweepBytemapScalar;
+  return 1;
+#else
+  sweepBytemap = sweepBytemapScalar;
+  return kernel == GC_SWEEP_AUTO || kernel == GC_SWEEP_SCALAR;
+#endif
+}
+
+static ObjectHeader ** closeFreeLines(ArenaHeader * arena,
+                                      ObjectHeader ** tail,
+                                      int from, int to) {
+  getLineSpans(arena)[from] = to - from;
+  if (to - from > arena->longest_run) arena->longest_run = to - from;
+  if (to - from >= MIN_LINE_RUN) {
+    ObjectHeader * run = (ObjectHeader*)(getArenaFirst(arena) +
+                                         ((size_t)from << LINE_SIZE_BITS));
+    *tail = run;
+    tail  = (ObjectHeader**)run;
+  }
+  return tail;
+}
+
+// Walks the objects and free runs of a line arena by their spans. Dead
+// objects merge with the free runs next to them, the runs long enough for
+// an object are listed in address order. Returns the lines in use.
+int sweepLines(ArenaHeader * arena) {
+  unsigned int live = getLiveCount(arena);
+  if (live != 0 && live >= arena->num_alloc) {
+    // Everything allocated is live
+    return arena->num_alloc;
+  }
+
+  unsigned short * spans = getLineSpans(arena);
+  char *           first = (char*)getArenaFirst(arena);
+  int              num   = arena->num_objects;
+  arena->free        = first;
+  arena->limit       = first;
+  arena->longest_run = 0;
+  if (live == 0) {
+    arena->limit       = (void*)getArenaEnd(arena);
+    arena->free_list   = NULL;
+    arena->longest_run = num;
+    spans[0]           = num;
+    return 0;
+  }
+
+  ObjectHeader ** tail = &arena->free_list;
+  int             used = 0;
+  int             run  = -1;
+  for (int l = 0; l < num; l += spans[l]) {
+    assert(spans[l] > 0 && l + spans[l] <= num);
+    char * o = first + ((size_t)l << LINE_SIZE_BITS);
+    if (!isMarkWhite(o)) {
+      if (run >= 0) tail = closeFreeLines(arena, tail, run, l);
+      run   = -1;
+      used += spans[l];
+      continue;
+    }
+    if (run < 0) run = l;
+#ifdef DEBUG
+    for (int i = 0; i < spans[l]; i++) {
+      zapObject((ObjectHeader*)(o + i * LINE_SIZE), arena);
+    }
+#endif
+  }
+  if (run >= 0) tail = closeFreeLines(arena, tail, run, num);
+  *tail = NULL;
+  return used;
+}
+
+// Rebuilds the free list of the arena and returns its number of live
+// objects. Touches nothing but the arena, thus an arena which is in no list
+// can be swept without HeapLock. The live count of the marking tells when
+// there is nothing to sweep.
+int sweepArenaObjects(ArenaHeader * arena) {
+  if (arena->segment == LINE_SEGMENT) {
+    return sweepLines(arena);
+  }
+  if (arena->segment >= NUM_ARENA_SEGMENTS) {
+    assert(getNumObjects(arena) == 1);
+    assert(arena->num_alloc == 1);
+  }
 
   int num_alloc = arena->num_objects;
   if (arena->segment < NUM_FIXED_HEAP_SEGMENTS) {
-    stackReset(&arena->free_list);
+    // Only the objects below the bump pointer were ever allocated. Dead ones
+    // right below it are handed back to the bump space.
+    size_t size   = getObjectSize(arena);
+    char * first  = (char*)getArenaFirst(arena);
+    int    bumped = ((char*)arena->free - first) / size;
+    int    live   = getLiveCount(arena);
+    if (live == 0) {
+      bumped = 0;
+    } else if (live >= bumped) {
+      // Everything allocated is live, the free list is empty
+      return arena->num_alloc;
+    }
+    while (bumped > 0 && isMarkWhite(first + (bumped - 1) * size)) {
+      bumped--;
+    }
+    arena->free      = first + bumped * size;
+    arena->free_list = NULL;
+    num_alloc        = bumped;
+
+#ifndef USE_MARK_BITMAP
+    num_alloc -= sweepBytemap(arena, bumped);
+#else
+    MarkWord * word  = (MarkWord*)getBytemap(arena);
+    int        words = getMarkMapSize(bumped) / sizeof(MarkWord);
+
+    for (int w = 0; w < words; w++) {
+      MarkWord dead = ~word[w];
+      int      tail = bumped - w * MARK_WORD_BITS;
+      if (tail < MARK_WORD_BITS) {
+        dead &= ((MarkWord)1 << tail) - 1;
+      }
+      num_alloc -= __builtin_popcountll(dead);
+      // Visit the dead objects of this word only
+      while (dead != 0) {
+        int bit = __builtin_ctzll(dead);
+        ObjectHeader * o = (ObjectHeader*)
+          (first + (w * MARK_WORD_BITS + bit) * size);
+        pushFreeObject(arena, o);
+        dead &= dead - 1;
+      }
+    }
+#endif
+  } else {
+    if (isMarkWhite((void*)getArenaFirst(arena))) {
+      num_alloc--;
+    }
+  }
+  return num_alloc;
+}
+
+void setArenaNumAlloc(ArenaHeader * arena, int num_alloc) {
+  HeapStruct * heap = &Heap[arena->gc_class][arena->segment];
+  heap->alloc_count -= arena->num_alloc;
+  heap->used_bytes  -= (size_t)arena->num_alloc * getObjectSize(arena);
+  arena->num_alloc   = num_alloc;
+  heap->alloc_count += num_alloc;
+  heap->used_bytes  += (size_t)num_alloc * getObjectSize(arena);
+}
+
+void sweepArena(ArenaHeader * arena) {
+  setArenaNumAlloc(arena, sweepArenaObjects(arena));
+}
+
+void removeArena(ArenaHeader * arena) {
+  Heap[arena->gc_class][arena->segment].used_bytes -=
+    (size_t)arena->num_alloc * getObjectSize(arena);
+  if (arena->segment < NUM_ARENA_SEGMENTS) {
+    Heap[arena->gc_class][arena->segment].size--;
+  }
+  freeArena(arena);
+}
+
+// Requires HeapLock. Accounts for the result of lazily sweeping an arena,
+// has_marks tells if any object of the arena was marked and num_alloc is as
+// returned by sweepArenaObjects. Returns 0 if the arena was empty and got released.
+int finishLazySweep(ArenaHeader * arena, int has_marks, int num_alloc) {
+  assert(arena->needs_sweep);
+  size_t before = (size_t)arena->num_alloc * getObjectSize(arena);
+  if (!has_marks) {
+    Heap[arena->gc_class][arena->segment].alloc_count -= arena->num_alloc;
+    heapSurvivors -= before < heapSurvivors ? before : heapSurvivors;
+    removeArena(arena);
+    return 0;
+  }
+  setArenaNumAlloc(arena, num_alloc);
+  sweepingDone(arena);
+  size_t freed = before - (size_t)arena->num_alloc * getObjectSize(arena);
+  heapSurvivors -= freed < heapSurvivors ? freed : heapSurvivors;
+  return 1;
+}
+
+// Returns 0 if the arena was empty and got released
+int lazySweepArena(ArenaHeader * arena) {
+  int has_marks = getLiveCount(arena) > 0;
+  return finishLazySweep(arena, has_marks,
+                         has_marks ? sweepArenaObjects(arena) : 0);
+}
+
+// Lazy sweeping: only flag candidates and move them to the unswept list,
+// the allocator or the background sweeper sweep them on demand
+void flagSweepingCandidates(int class, int segment, int full_gc) {
+  HeapStruct * heap = &Heap[class][segment];
+  for (int l = 0; l < NUM_ARENA_LISTS; l++) {
+    if (l == SWEEP_ARENA_LIST) continue;
+    ArenaHeader ** prev = getArenaList(heap, l);
+    while (*prev != NULL) {
+      ArenaHeader * arena = *prev;
+      if (full_gc) arena->was_full = 0;
+      if (getLiveCount(arena) == 0) {
+        // Nothing was marked, no need to wait for the sweeper
+        *prev = arena->next;
+        heap->alloc_count -= arena->num_alloc;
+        removeArena(arena);
+        continue;
+      }
+      if (full_gc || isSweepingCandidate(arena)) {
+        arena->needs_sweep = 1;
+      }
+      // Also arenas flagged before, claimed while marking concurrently
+      if (arena->needs_sweep) {
+        *prev = arena->next;
+        pushSweepArena(arena);
+      } else {
+        prev = &arena->next;
+      }
+    }
+  }
+}
+
+static unsigned long promotedArenas = 0;
+
+void moveArenaToClass(ArenaHeader * arena, int class) {
+  HeapStruct * from = &Heap[arena->gc_class][arena->segment];
+  HeapStruct * to   = &Heap[class][arena->segment];
+  from->size--;
+  from->object_count -= arena->num_objects;
+  from->alloc_count  -= arena->num_alloc;
+  from->used_bytes   -= (size_t)arena->num_alloc * getObjectSize(arena);
+  to->size++;
+  to->object_count   += arena->num_objects;
+  to->alloc_count    += arena->num_alloc;
+  to->used_bytes     += (size_t)arena->num_alloc * getObjectSize(arena);
+  arena->gc_class = class;
+}
+
+// Survivors of class 0 GCs stay marked (sticky mark bits), thus are already
+// logically promoted. Arenas which filled up with survivors are moved to
+// class 1, so that class 0 GCs do not have to visit them anymore.
+void promoteArenas(int segment) {
+  assert(segment < NUM_ARENA_SEGMENTS);
+  ArenaHeader ** prev = &Heap[0][segment].full_arena;
+  while (*prev != NULL) {
+    ArenaHeader * arena = *prev;
+    if (arena->was_full && !arena->needs_sweep) {
+      *prev = arena->next;
+      moveArenaToClass(arena, 1);
+      arena->promoted = 1;
+      arena->next = Heap[1][segment].full_arena;
+      Heap[1][segment].full_arena = arena;
+      promotedArenas++;
+    } else {
+      prev = &arena->next;
+    }
+  }
+}
+
+// Promoted arenas with free space after a class 1 GC are handed back to
+// class 0, which is the only one allocating from them.
+void demoteArenas(int segment) {
+  assert(segment < NUM_ARENA_SEGMENTS);
+  for (int l = 0; l <= SWEEP_ARENA_LIST; l++) {
+    ArenaHeader ** prev = getArenaList(&Heap[1][segment], l);
+    while (*prev != NULL) {
+      ArenaHeader * arena = *prev;
+      if (arena->promoted) {
+        *prev = arena->next;
+        moveArenaToClass(arena, 0);
+        arena->promoted = 0;
+        if (arena->needs_sweep) {
+          pushSweepArena(arena);
+        } else {
+          pushFreeArena(arena);
+        }
+      } else {
+        prev = &arena->next;
+      }
+    }
+  }
+}
+
+
+/*
+ * Parallel sweeping
+ *
+ */
+
+// Arenas are independent, thus the arenas to sweep (or to clear) are
+// collected into one array, which the gc threads claim arenas from. Heap
+// lists and counts are only updated afterwards.
+
+static SweepWorker SweepWorkers[MAX_GC_THREADS];
+static SweepItem * sweepWork         = NULL;
+static int         sweepWorkSize     = 0;
+static int         sweepWorkCapacity = 0;
+static int         sweepWorkNext     = 0;
+
+void addSweepWork(ArenaHeader * arena, int from_full) {
+  if (sweepWorkSize == sweepWorkCapacity) {
+    sweepWorkCapacity = sweepWorkCapacity ? sweepWorkCapacity * 2 : 1024;
+    sweepWork = realloc(sweepWork, sweepWorkCapacity * sizeof(SweepItem));
+    if (sweepWork == NULL) {
+      fatalError("Could not grow the sweep work");
+    }
+  }
+  sweepWork[sweepWorkSize].arena     = arena;
+  sweepWork[sweepWorkSize].from_full = from_full;
+  sweepWorkSize++;
+}
+
+SweepItem * nextSweepWork() {
+  int i = __atomic_fetch_add(&sweepWorkNext, 1, __ATOMIC_RELAXED);
+  return i < sweepWorkSize ? &sweepWork[i] : NULL;
+}
+
+// Released arenas are taken out of the work
+void sweepWorker(int id) {
+  SweepWorker * worker = &SweepWorkers[id];
+  SweepItem *   item;
+  while ((item = nextSweepWork()) != NULL) {
+    ArenaHeader * arena     = item->arena;
+    int           num_alloc = sweepArenaObjects(arena);
+    worker->alloc_count[arena->gc_class][arena->segment] +=
+      num_alloc - arena->num_alloc;
+    worker->used_bytes[arena->gc_class][arena->segment] +=
+      ((long long)num_alloc - arena->num_alloc) * getObjectSize(arena);
+    arena->num_alloc = num_alloc;
+    sweepingDone(arena);
+    if (num_alloc == 0) {
+      item->arena      = NULL;
+      arena->next      = worker->released;
+      worker->released = arena;
+    }
+  }
+}
+
+void clearMarksWorker(int id) {
+  SweepItem * item;
+  while ((item = nextSweepWork()) != NULL) {
+    clearAllMarks(item->arena);
+  }
+}
+
+void runSweepWork(void (*task)(int)) {
+  memset(SweepWorkers, 0, markThreads * sizeof(SweepWorker));
+  sweepWorkNext = 0;
+  runOnWorkers(task, markThreads);
 
-    char * mark               = getBytemap(arena);
-    char * end                = &getBytemap(arena)[arena->num_objects];
-    ObjectHeader * finger     = (ObjectHeader*)getArenaFirst(arena);
+  for (int w = 0; w < markThreads; w++) {
+    SweepWorker * worker = &SweepWorkers[w];
+    for (int class = 0; class < NUM_CLASSES; class++) {
+      for (int i = 0; i < NUM_HEAP_SEGMENTS; i++) {
+        Heap[class][i].alloc_count += worker->alloc_count[class][i];
+        Heap[class][i].used_bytes  += worker->used_bytes[class][i];
+      }
+    }
+    while (worker->released != NULL) {
+      ArenaHeader * arena = worker->released;
+      worker->released = arena->next;
+      removeArena(arena);
+    }
+  }
+}
+
+// Large objects have nothing to sweep, dead ones are released right away.
+// Only the headers of those are touched.
+void sweepLargeObjects(int class, int segment) {
+  HeapStruct * heap  = &Heap[class][segment];
+  LargeIndex * index = &LargeObjects[class];
+  unsigned int slot  = 0;
+  while (slot < index->size) {
+    if (index->epoch[slot] == gcMarkEpoch) {
+      slot++;
+      continue;
+    }
+    ArenaHeader * arena = index->arena[slot];
+    assert(getLiveCount(arena) == 0);
+    removeLargeObject(index, slot);
+    if (arena->prev != NULL) {
+      arena->prev->next = arena->next;
+    } else {
+      heap->full_arena  = arena->next;
+    }
+    if (arena->next != NULL) arena->next->prev = arena->prev;
+    heap->alloc_count -= arena->num_alloc;
+    removeArena(arena);
+  }
+}
+
+void gcSweep(int full_gc, int segment) {
+  int max_class = gcCurrentClass();
+  assert(max_class <= NUM_CLASSES && max_class > 0);
+  sweepWorkSize = 0;
+  for (int class = 0; class < max_class; class++) {
+    for (int i = 0; i < NUM_HEAP_SEGMENTS; i++) {
+      if (i >= NUM_ARENA_SEGMENTS) {
+        sweepLargeObjects(class, i);
+        continue;
+      }
+
+      if (lazySweepingEnabled && i < NUM_ARENA_SEGMENTS) {
+        flagSweepingCandidates(class, i, full_gc);
+        continue;
+      }
+
+      // Arenas to sweep are taken out of the lists. Arenas left unswept by
+      // lazy sweeping are swept now.
+      ArenaHeader * lists[SWEEP_ARENA_LIST + 1];
+      for (int l = 0; l <= SWEEP_ARENA_LIST; l++) {
+        lists[l] = *getArenaList(&Heap[class][i], l);
+        *getArenaList(&Heap[class][i], l) = NULL;
+      }
+      for (int l = 0; l <= SWEEP_ARENA_LIST; l++) {
+        ArenaHeader * arena = lists[l];
+        while (arena != NULL) {
+          ArenaHeader * next = arena->next;
+          if (full_gc) arena->was_full = 0;
+          if (full_gc || arena->needs_sweep || isSweepingCandidate(arena)) {
+            addSweepWork(arena, 0);
+          } else {
+            pushFreeArena(arena);
+          }
+          arena = next;
+        }
+      }
+      ArenaHeader ** prev_full = &Heap[class][i].full_arena;
+      while (*prev_full != NULL) {
+        ArenaHeader * arena = *prev_full;
+        if (full_gc) arena->was_full = 0;
+        if (full_gc || isSweepingCandidate(arena)) {
+          *prev_full = arena->next;
+          addSweepWork(arena, 1);
+          continue;
+        }
+        prev_full = &arena->next;
+      }
+    }
+  }
+
+  // Empty arenas are released by runSweepWork
+  runSweepWork(sweepWorker);
+
+  // Swept arenas are filed into the bin of their new occupancy. Taking from
+  // the fullest bin first creates more full arenas, which do not have to be
+  // swept. Full arenas stay full unless they got empty space.
+  for (int w = 0; w < sweepWorkSize; w++) {
+    ArenaHeader * arena = sweepWork[w].arena;
+    if (arena == NULL) continue;
+    if (sweepWork[w].from_full && isArenaConsideredFull(arena)) {
+      HeapStruct * heap = &Heap[arena->gc_class][arena->segment];
+      arena->next = heap->full_arena;
+      heap->full_arena = arena;
+    } else {
+      pushFreeArena(arena);
+    }
+  }
+
+  if (NUM_CLASSES > 1) {
+    for (int i = 0; i < NUM_ARENA_SEGMENTS; i++) {
+      if (max_class > 1) demoteArenas(i);
+      promoteArenas(i);
+    }
+  }
+}
+
+unsigned int getDiff(struct timespec a, struct timespec b) {
+  if (a.tv_sec == b.tv_sec) {
+    return (b.tv_nsec - a.tv_nsec) / 100000;
+  } else {
+    return (1000000000L - a.tv_nsec + b.tv_nsec +
+            (1000000000L * (b.tv_sec - a.tv_sec - 1))) / 100000;
+  }
+}
+
+void gcForceRun() {
+  lockHeap();
+  doGc(1, 0);
+  unlockHeap();
+}
+
+void gcCompact() {
+  lockHeap();
+  evacuationRequested = 1;
+  doGc(1, 0);
+  evacuationRequested = 0;
+  unlockHeap();
+}
+
+static unsigned long total_time = 0;
+
+void stopTheWorld();
+void resumeTheWorld();
+void startBackgroundSweeper();
+void stopBackgroundSweeper();
+void finishIncrementalMark();
+
+void clearHeapMarks() {
+  stackReset(&MarkStack);
+  sweepWorkSize = 0;
+  for (int class = 0; class < gcCurrentClass(); class++) {
+    memset(LargeObjects[class].epoch, 0, LargeObjects[class].size);
+    for (int i = 0; i < NUM_HEAP_SEGMENTS; i++) {
+      // Nothing is flagged anymore
+      ArenaHeader * arena;
+      while ((arena = popSweepArena(class, i)) != NULL) {
+        pushFreeArena(arena);
+      }
+      for (int l = 0; l < NUM_ARENA_LISTS; l++) {
+        arena = *getArenaList(&Heap[class][i], l);
+        while (arena != NULL) {
+          addSweepWork(arena, 0);
+          arena = arena->next;
+        }
+      }
+    }
+  }
+  runSweepWork(clearMarksWorker);
+}
+
+// Starts the marking of a full GC. A new epoch turns all marks white without
+// touching the bytemaps, they are only cleared when the epoch wraps around.
+void startMarkEpoch() {
+#ifndef USE_MARK_BITMAP
+  if (gcMarkEpoch < MAX_MARK_EPOCH) {
+    stackReset(&MarkStack);
+    // The live counts of the old epoch read as 0 from now on
+    gcMarkEpoch++;
+    return;
+  }
+  gcMarkEpoch = 1;
+#endif
+  clearHeapMarks();
+}
+
+#ifdef USE_CARD_MARKING
+
+// Unmarked objects are traced in whole once they get marked
+static inline int isCardParent(void * o) {
+#ifndef USE_MARK_BITMAP
+  return isMarkBlack(o);
+#else
+  return !isMarkWhite(o);
+#endif
+}
+
+static inline int hasDirtyCards(ArenaHeader * arena) {
+  long * word = (long*)arena->cards;
+  for (unsigned int w = 0; w < arena->num_cards / sizeof(long); w++) {
+    if (word[w] != 0) return 1;
+  }
+  return 0;
+}
+
+// Any card dirty from the header to the last slot of o
+int isObjectDirty(ObjectHeader * o) {
+  ArenaHeader *   arena = chunkFromPtr(o);
+  unsigned char * last  = getCard(arena, (char*)CHILD_SLOT(o,
+                                                   NUM_CHILDREN(o)) - 1);
+  for (unsigned char * c = getCard(arena, o); c <= last; c++) {
+    if (*c) return 1;
+  }
+  return 0;
+}
+
+// Forwards the children of o stored in [from, to)
+static void rescanChildren(ObjectHeader * o, uintptr_t from, uintptr_t to) {
+  uintptr_t slots = (uintptr_t)CHILD_SLOT(o, 0);
+  long      size  = sizeof(ObjectHeader*);
+  long      first = from > slots ? (from - slots + size - 1) / size : 0;
+  long      last  = to > slots ? (to - slots + size - 1) / size : 0;
+  if (last > NUM_CHILDREN(o)) last = NUM_CHILDREN(o);
+  DO_CHILDREN_RANGE(o, first, last, _FORWARD_CHILD_IF_UNMARKED, 0);
+}
+
+// Objects of a line arena differ in size, thus it is walked along the line
+// spans and the cards of every marked object are checked
+static void rescanLineCards(ArenaHeader * arena) {
+  uintptr_t        base  = (uintptr_t)arena;
+  uintptr_t        first = getArenaFirst(arena);
+  unsigned short * spans = getLineSpans(arena);
+  for (int line = 0; line < getNumObjects(arena); line += spans[line]) {
+    ObjectHeader * o = (ObjectHeader*)(first + ((uintptr_t)line <<
+                                                LINE_SIZE_BITS));
+    if (!isCardParent(o)) continue;
+    uintptr_t end  = (uintptr_t)CHILD_SLOT(o, NUM_CHILDREN(o));
+    uintptr_t card = ((uintptr_t)o - base) >> GC_CARD_BITS;
+    uintptr_t last = (end - 1 - base) >> GC_CARD_BITS;
+    for (; card <= last; card++) {
+      if (arena->cards[card] == 0) continue;
+      uintptr_t from = base + (card << GC_CARD_BITS);
+      rescanChildren(o, from, from + (1 << GC_CARD_BITS));
+    }
+  }
+  memset(arena->cards, 0, arena->num_cards);
+}
+
+#endif
+
+void rescanDirtyCards(ArenaHeader * arena) {
+#ifdef USE_CARD_MARKING
+  if (!hasDirtyCards(arena)) return;
+  if (arena->segment == LINE_SEGMENT) {
+    rescanLineCards(arena);
+    return;
+  }
+  uintptr_t base  = (uintptr_t)arena;
+  uintptr_t first = getArenaFirst(arena);
+  uintptr_t top   = getArenaTop(arena);
+  size_t    size  = getObjectSize(arena);
+  long *    word  = (long*)arena->cards;
+  for (unsigned int w = 0; w < arena->num_cards / sizeof(long); w++) {
+    if (word[w] == 0) continue;
+    for (int c = w * sizeof(long); c < (w + 1) * sizeof(long); c++) {
+      if (arena->cards[c] == 0) continue;
+      arena->cards[c] = 0;
+      uintptr_t from = base + ((uintptr_t)c << GC_CARD_BITS);
+      uintptr_t to   = from + (1 << GC_CARD_BITS);
+      // The object the card starts in and the ones starting on it
+      uintptr_t o    = from < first ? first :
+                                      first + (from - first) / size * size;
+      for (; o < to && o < top; o += size) {
+        if (isCardParent((void*)o)) {
+          rescanChildren((ObjectHeader*)o, from, to);
+        }
+      }
+    }
+  }
+#endif
+}
+
+// Forwards the children stored into marked parents since the last GC
+void rescanHeapCards() {
+#ifdef USE_CARD_MARKING
+  for (int class = 0; class < NUM_CLASSES; class++) {
+    for (int i = 0; i < NUM_HEAP_SEGMENTS; i++) {
+      for (int l = 0; l < NUM_ARENA_LISTS; l++) {
+        ArenaHeader * arena = *getArenaList(&Heap[class][i], l);
+        while (arena != NULL) {
+          rescanDirtyCards(arena);
+          arena = arena->next;
+        }
+      }
+    }
+  }
+#endif
+}
+
+size_t evacuateSparseArenas();
+
+// Requires a stopped world
+size_t heapUsedBytes() {
+  size_t used = 0;
+  for (int class = 0; class < NUM_CLASSES; class++) {
+    for (int i = 0; i < NUM_HEAP_SEGMENTS; i++) {
+      used += Heap[class][i].used_bytes;
+    }
+  }
+  return used;
+}
+
+static struct timespec concurrentMarkStart;
+
+// Requires HeapLock
+void doGc(int full_gc, int segment) {
+  stopTheWorld();
+  gcCount++;
+  pacerStartCycle();
+
+  // Finishing a concurrent cycle: marks are valid, only remark is left
+  int remark = gcMarkingActive;
+  if (remark) {
+    full_gc = 1;
+  } else {
+    updateMaxClass(full_gc);
+  }
+
+  assert(gcCurrentClass() <= NUM_CLASSES);
+
+#ifdef DEBUG
+  if (!remark) verifyHeap();
+#endif
+
+  if (gcReportingEnabled) {
+    printf("--- %s GC initiated [max_class %d]:\n",
+        remark ? "Remark" : (full_gc ? "Full" : "Partial"),
+        gcCurrentClass());
+    printMemoryStatistics();
+  }
+  if (remark) finishIncrementalMark();
+
+  static struct timespec a, b, c, d, e;
+  if (gcReportingEnabled) clock_gettime(CLOCK_REALTIME, &a);
+
+  if (full_gc && !remark) {
+    startMarkEpoch();
+  } else {
+    rescanHeapCards();
+  }
+
+  struct timespec mark_start;
+  clock_gettime(CLOCK_MONOTONIC, &mark_start);
+  if (gcReportingEnabled) clock_gettime(CLOCK_REALTIME, &b);
+  gcMarkWrapper();
+  gcMarkingActive = 0;
+  double mark_seconds = secondsSince(remark ? &concurrentMarkStart :
+                                              &mark_start);
+#ifdef DEBUG
+  verifyHeap();
+#endif
+  if (gcReportingEnabled) clock_gettime(CLOCK_REALTIME, &c);
+  size_t evacuated = 0;
+  if (full_gc && evacuationRequested) {
+    evacuated = evacuateSparseArenas();
+  }
+  if (gcReportingEnabled) clock_gettime(CLOCK_REALTIME, &e);
+  gcSweep(full_gc, segment);
+  trimArenaPool();
+  trimLargeMappingCache(largeCacheMaxAge);
+  pacerEndCycle(full_gc, mark_seconds);
+  if (backgroundSweepingEnabled) startBackgroundSweeper();
+  if (gcReportingEnabled) clock_gettime(CLOCK_REALTIME, &d);
+
+#ifdef DEBUG
+  verifyHeap();
+#endif
+
+  if (gcReportingEnabled) {
+    total_time += getDiff(a,d) / 10;
+    if (full_gc && !remark) {
+      printf("clearing mark bits took: %d 10ms\n", getDiff(a, b));
+    }
+    printf("marking took: %d 10ms\n", getDiff(b, c));
+    if (full_gc && evacuationRequested) {
+      printf("evacuation took: %d 10ms, reclaimed %lu KB\n",
+          getDiff(c, e), evacuated / 1024);
+    }
+    printf("sweeping took: %d 10ms\n", getDiff(e, d));
+    printf("promoted arenas: %lu\n", promotedArenas);
+    printf("pacer: heap %lu MB, goal %lu MB, survivors %lu MB, "
+           "allocating %.0f MB/s, survival %.2f\n",
+        heapSize / 1048576, heapGoal / 1048576, heapSurvivors / 1048576,
+        allocationRate / 1048576, survivalRate);
+    printf("total: %lu ms\n", total_time);
+    printMemoryStatistics();
+  }
+
+  resumeTheWorld();
+}
+
+void gcInit() {
+  for (int class = 0; class < NUM_CLASSES; class++) {
+    for (int i = 0; i < NUM_HEAP_SEGMENTS; i++) {
+      for (int bin = 0; bin < FREE_ARENA_BINS; bin++) {
+        Heap[class][i].free_arena[bin] = NULL;
+      }
+      Heap[class][i].full_arena      = NULL;
+      Heap[class][i].size            = 0;
+    }
+  }
+
+  assert(heapSegmentNodeSize(NUM_FIXED_HEAP_SEGMENTS-1) ==
+         LARGEST_FIXED_SEGMENT_SIZE);
+  //assert(SMALLEST_SEGMENT_SIZE >= sizeof(ObjectHeader));
+  //assert(SMALLEST_SEGMENT_SIZE <= (1<<(1+(int)log2(sizeof(ObjectHeader)))));
+
+#ifdef DEBUG
+  checkFixedSegmentSizes();
+#endif
+  gcSetSweepKernel(GC_SWEEP_AUTO);
+
+  if (LargeObjects[0].arena == NULL) reserveLargeIndex();
+
+  MarkStack = allocStackChunk();
+  RootPins  = allocStackChunk();
+  clock_gettime(CLOCK_MONOTONIC, &lastGcEnd);
+
+  gcRegisterThread();
+}
+
+void gcTeardown() {
+  gcForceRun();
+  lockHeap();
+  stopBackgroundSweeper();
+  unlockHeap();
+  gcUnregisterThread();
+  for (int class = 0; class < NUM_CLASSES; class++) {
+    for (int i = 0; i < NUM_HEAP_SEGMENTS; i++) {
+      for (int l = 0; l < NUM_ARENA_LISTS; l++) {
+        ArenaHeader * arena = *getArenaList(&Heap[class][i], l);
+        while (arena != NULL) {
+          ArenaHeader * next = arena->next;
+          removeArena(arena);
+          arena = next;
+        }
+      }
+      if (i < NUM_ARENA_SEGMENTS) {
+        assert(Heap[class][i].size == 0);
+      }
+    }
+    LargeObjects[class].size = 0;
+  }
+  ArenaHeader * arena;
+  while ((arena = takePooledArena()) != NULL) {
+    unmapArena(arena);
+  }
+  trimLargeMappingCache(-1);
+}
+
+
+/*
+ * Threads
+ *
+ */
+
+static int numParked   = 0;
+static int gcRequested = 0;
+
+// Requires HeapLock. Blocks until the requested GC is done.
+void parkThread() {
+  numParked++;
+  pthread_cond_broadcast(&SafepointCond);
+  while (gcRequested) {
+    pthread_cond_wait(&SafepointCond, &HeapLock);
+  }
+  numParked--;
+}
+
+void lockHeap() {
+  pthread_mutex_lock(&HeapLock);
+  while (gcRequested) {
+    parkThread();
+  }
+}
+
+void unlockHeap() {
+  pthread_mutex_unlock(&HeapLock);
+}
+
+void gcSafepoint() {
+  if (__atomic_load_n(&gcRequested, __ATOMIC_ACQUIRE)) {
+    lockHeap();
+    unlockHeap();
+  }
+}
+
+// Requires HeapLock or a stopped world
+void releaseThreadArenas(ThreadContext * thread) {
+  for (int class = 0; class < NUM_CLASSES; class++) {
+    for (int i = 0; i < NUM_ARENA_SEGMENTS; i++) {
+      ArenaHeader * arena = thread->arena[class][i];
+      if (arena == NULL) continue;
+      unclaimArena(arena);
+      // Full list arenas are not allocated from until a full GC or enough
+      // garbage gets them swept. Bump space left is no garbage, such an
+      // arena stays in a free bin to not leave the space idle.
+      if (isArenaConsideredFull(arena) &&
+          (uintptr_t)arena->free >= getArenaEnd(arena)) {
+        arena->next = Heap[class][i].full_arena;
+        Heap[class][i].full_arena = arena;
+      } else {
+        pushFreeArena(arena);
+      }
+      thread->arena[class][i] = NULL;
+
+    }
+  }
+  ObjectHeader * o;
+  while ((o = stackPop(&thread->mark_buffer)) != NULL) {
+    // A concurrent marker might have blackened it since
+    setMarkGrey(o);
+    stackPush(&MarkStack, o);
+  }
+}
+
+void stopConcurrentMarker();
+
+// Requires HeapLock
+void stopTheWorld() {
+  assert(LocalThread.registered);
+  __atomic_store_n(&gcRequested, 1, __ATOMIC_RELEASE);
+  while (numParked < numThreads - 1) {
+    pthread_cond_wait(&SafepointCond, &HeapLock);
+  }
+  stopConcurrentMarker();
+  stopBackgroundSweeper();
+  for (ThreadContext * t = Threads; t != NULL; t = t->next) {
+    releaseThreadArenas(t);
+    mergeAllocStats(t);
+  }
+  gcCollecting = 1;
+}
+
+void resumeTheWorld() {
+  gcCollecting = 0;
+  __atomic_store_n(&gcRequested, 0, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&SafepointCond);
+}
+
+void gcRegisterThread() {
+  assert(!LocalThread.registered);
+  pthread_mutex_lock(&HeapLock);
+  // Not counted as a mutator yet, thus wait without parking
+  while (gcRequested) {
+    pthread_cond_wait(&SafepointCond, &HeapLock);
+  }
+  memset(&LocalThread, 0, sizeof(ThreadContext));
+  LocalThread.mark_buffer = allocStackChunk();
+  LocalThread.registered  = 1;
+  LocalThread.next        = Threads;
+  Threads = &LocalThread;
+  numThreads++;
+  pthread_mutex_unlock(&HeapLock);
+}
+
+void gcUnregisterThread() {
+  assert(LocalThread.registered);
+  lockHeap();
+  releaseThreadArenas(&LocalThread);
+  mergeAllocStats(&LocalThread);
+  stackFree(LocalThread.mark_buffer);
+  ThreadContext ** t = &Threads;
+  while (*t != &LocalThread) {
+    t = &(*t)->next;
+  }
+  *t = LocalThread.next;
+  LocalThread.registered = 0;
+  numThreads--;
+  // A GC might be waiting for this thread to park
+  pthread_cond_broadcast(&SafepointCond);
+  unlockHeap();
+}
+
+
+/*
+ * GC worker threads
+ *
+ */
+
+static pthread_mutex_t WorkerLock     = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  WorkerCond     = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t  WorkerDoneCond = PTHREAD_COND_INITIALIZER;
+
+static int            numWorkers       = 0;
+static int            workersActive    = 0;
+static int            workersRunning   = 0;
+static unsigned long  workerGeneration = 0;
+static void        (* workerTask)(int) = NULL;
+
+// The generation a worker was started in, as it may first run after the next
+static unsigned long  workerStartGeneration[MAX_GC_THREADS];
+
+void * workerLoop(void * arg) {
+  int id = (long)arg;
+  pthread_mutex_lock(&WorkerLock);
+  unsigned long seen = workerStartGeneration[id];
+  while (1) {
+    while (workerGeneration == seen) {
+      pthread_cond_wait(&WorkerCond, &WorkerLock);
+    }
+    seen = workerGeneration;
+    if (id >= workersActive) continue;
+
+    void (*task)(int) = workerTask;
+    pthread_mutex_unlock(&WorkerLock);
+    task(id);
+    pthread_mutex_lock(&WorkerLock);
+
+    if (--workersRunning == 0) {
+      pthread_cond_signal(&WorkerDoneCond);
+    }
+  }
+  return NULL;
+}
+
+// Worker 0 is the calling thread
+void startWorkers(int num) {
+  assert(num <= MAX_GC_THREADS);
+  while (numWorkers < num - 1) {
+    pthread_t thread;
+    numWorkers++;
+    pthread_mutex_lock(&WorkerLock);
+    workerStartGeneration[numWorkers] = workerGeneration;
+    pthread_mutex_unlock(&WorkerLock);
+    if (pthread_create(&thread, NULL, workerLoop, (void*)(long)numWorkers)) {
+      fatalError("Could not start gc worker thread");
+    }
+    pthread_detach(thread);
+  }
+}
+
+// Runs task(0) ... task(num-1) in parallel and waits for all to finish
+void runOnWorkers(void (*task)(int), int num) {
+  assert(num - 1 <= numWorkers);
+  pthread_mutex_lock(&WorkerLock);
+  workerTask     = task;
+  workersActive  = num;
+  workersRunning = num - 1;
+  workerGeneration++;
+  pthread_cond_broadcast(&WorkerCond);
+  pthread_mutex_unlock(&WorkerLock);
+
+  task(0);
+
+  pthread_mutex_lock(&WorkerLock);
+  while (workersRunning > 0) {
+    pthread_cond_wait(&WorkerDoneCond, &WorkerLock);
+  }
+  pthread_mutex_unlock(&WorkerLock);
+}
+
+void gcSetMarkThreads(int num) {
+  assert(num > 0);
+  if (num > MAX_GC_THREADS) num = MAX_GC_THREADS;
+  lockHeap();
+  startWorkers(num);
+  for (int i = 0; i < num; i++) {
+    if (MarkWorkers[i] == NULL) {
+      MarkWorkers[i] = malloc(sizeof(MarkWorker));
+      dequeInit(&MarkWorkers[i]->deque);
+      MarkWorkers[i]->overflow = allocStackChunk();
+    }
+  }
+  markThreads = num;
+  unlockHeap();
+}
+
+
+/*
+ * Concurrent marking
+ *
+ */
+
+static pthread_mutex_t MarkerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  MarkerCond = PTHREAD_COND_INITIALIZER;
+
+static int markerRunning  = 0;
+static int markerStop     = 0;
+static int markerFinished = 0;
+
+void * concurrentMarkerLoop(void * arg) {
+  pthread_mutex_lock(&MarkerLock);
+  while (1) {
+    while (!markerRunning) {
+      pthread_cond_wait(&MarkerCond, &MarkerLock);
+    }
+    pthread_mutex_unlock(&MarkerLock);
+
+    drainMarkStack(&markerStop);
+
+    pthread_mutex_lock(&MarkerLock);
+    if (!markerStop) {
+      __atomic_store_n(&markerFinished, 1, __ATOMIC_RELEASE);
+    }
+    markerRunning = 0;
+    pthread_cond_broadcast(&MarkerCond);
+  }
+  return NULL;
+}
+
+int concurrentMarkFinished() {
+  return __atomic_load_n(&markerFinished, __ATOMIC_ACQUIRE);
+}
+
+// Afterwards the marker does not touch MarkStack until restarted
+void stopConcurrentMarker() {
+  if (!gcMarkingActive) return;
+  pthread_mutex_lock(&MarkerLock);
+  __atomic_store_n(&markerStop, 1, __ATOMIC_RELAXED);
+  while (markerRunning) {
+    pthread_cond_wait(&MarkerCond, &MarkerLock);
+  }
+  pthread_mutex_unlock(&MarkerLock);
+}
+
+void startIncrementalMark();
+
+// Requires HeapLock. Initial pause: clear the marks and grey the roots.
+// Without concurrent marking the mutator marks incrementally.
+void startConcurrentMark() {
+  stopTheWorld();
+
+  static struct timespec a, b;
+  if (gcReportingEnabled) {
+    printf("--- %s GC initiated:\n",
+        concurrentMarkingEnabled ? "Concurrent" : "Incremental");
+    clock_gettime(CLOCK_REALTIME, &a);
+  }
+
+  updateMaxClass(1);
+  startMarkEpoch();
+  clock_gettime(CLOCK_MONOTONIC, &concurrentMarkStart);
+
+  gcDeferMarking = 1;
+  gcMarkWrapper();
+  gcDeferMarking = 0;
+  gcMarkingActive = 1;
+
+  if (concurrentMarkingEnabled) {
+    pthread_mutex_lock(&MarkerLock);
+    markerStop     = 0;
+    markerFinished = 0;
+    markerRunning  = 1;
+    pthread_cond_broadcast(&MarkerCond);
+    pthread_mutex_unlock(&MarkerLock);
+  } else {
+    startIncrementalMark();
+  }
+
+  if (gcReportingEnabled) {
+    clock_gettime(CLOCK_REALTIME, &b);
+    printf("initial pause took: %d 10ms\n", getDiff(a, b));
+  }
+
+  resumeTheWorld();
+}
+
+void gcEnableConcurrentMarking(int enable) {
+  lockHeap();
+  if (enable && !concurrentMarkingEnabled) {
+    static int started = 0;
+    if (!started) {
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, concurrentMarkerLoop, NULL)) {
+        fatalError("Could not start concurrent marker thread");
+      }
+      pthread_detach(thread);
+      started = 1;
+    }
+  }
+  concurrentMarkingEnabled = enable;
+  unlockHeap();
+}
+
+
+/*
+ * Incremental marking
+ *
+ */
 
-    while (mark < end) {
-      assert(getMark(finger) == mark);
-      assert((uintptr_t)mark < getArenaFirst(arena));
-      assert((void*)mark >= (void*)(arena+1));
-      assert(*mark != GREY_MARK);
+// The mutator drains MarkStack in steps from the allocation slow path, in
+// proportion to what it allocated. Objects with more children than the
+// budget left are scanned in slices, the object in progress is kept here.
+static ObjectHeader * markSliceObject = NULL;
+static long           markSliceNext   = 0;
 
-      if (*mark == WHITE_MARK) {
-#ifdef DEBUG
-        long * f = (long*)finger;
-        for (int i = 0; i < getObjectSize(arena) / sizeof(long); i++) {
-          *f = kGcZapPointer;
-          f++;
-        }
+// Bounds of the allocation driven steps, the heap rather grows past the goal
+// than a step takes longer
+#ifndef MIN_MARK_STEP_WORDS
+#define MIN_MARK_STEP_WORDS 4096
 #endif
-        num_alloc--;
-        stackPush(&arena->free_list, finger);
-      } else {
-        assert(*mark == BLACK_MARK);
-      }
-      nextObject(&finger, arena);
-      mark++;
+#ifndef MAX_MARK_STEP_WORDS
+#define MAX_MARK_STEP_WORDS (1 << 20)
+#endif
+
+// Words to scan per byte allocated, set when a cycle starts
+static double        markWordsPerByte  = 0;
+static size_t        markStepAllocated = 0;
+static unsigned long markSteps         = 0;
+static double        markStepLongest   = 0;
+static double        markStepTotal     = 0;
+
+// Requires HeapLock. Scans grey objects worth up to budget words, headers
+// included. Returns 1 if grey objects are left.
+int drainMarkStackBudget(size_t budget) {
+  const size_t header = sizeof(ObjectHeader) / sizeof(void*);
+  while (1) {
+    ObjectHeader * cur  = markSliceObject;
+    long           from = markSliceNext;
+    if (cur == NULL) {
+      if (stackEmpty(MarkStack)) return 0;
+      if (budget < header) return 1;
+      budget -= header;
+      cur = stackPop(&MarkStack);
+      assert(!isMarkWhite(cur));
+      if (!needsScanning(cur)) continue;
+      from = 0;
     }
-  } else {
-    if (getBytemap(arena)[0] == WHITE_MARK) {
-      num_alloc--;
+    long to = NUM_CHILDREN(cur);
+    if ((size_t)(to - from) > budget) {
+      to = from + budget;
     }
+    // Other mutators might set marks, thus not unsynchronized
+    DO_CHILDREN_RANGE(cur, from, to, _FORWARD_CHILD_IF_UNMARKED, 1);
+    budget -= to - from;
+    if (to < NUM_CHILDREN(cur)) {
+      markSliceObject = cur;
+      markSliceNext   = to;
+      return 1;
+    }
+    markSliceObject = NULL;
+    setMarkBlack(cur);
   }
-  Heap[arena->gc_class][arena->segment].alloc_count -= arena->num_alloc;
-  arena->num_alloc = num_alloc;
-  Heap[arena->gc_class][arena->segment].alloc_count += num_alloc;
-}
-
-void removeArena(ArenaHeader * arena) {
-  if (arena->segment < NUM_FIXED_HEAP_SEGMENTS) {
-    Heap[arena->gc_class][arena->segment].size--;
-  }
-  freeArena(arena);
 }
 
-// sort by decreasing num_alloc (merge sort)
-ArenaHeader * sortFreeArenas(ArenaHeader * list) {
-  if (list == NULL) {
-      return NULL;
+// Requires HeapLock
+int markStep(size_t budget) {
+  // Parents greyed by the write barrier of this thread, a previous step
+  // might have blackened them since
+  ObjectHeader * o;
+  while ((o = stackPop(&LocalThread.mark_buffer)) != NULL) {
+    setMarkGrey(o);
+    stackPush(&MarkStack, o);
   }
 
-  int segmentation = 1;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int left = drainMarkStackBudget(budget);
+  double took = secondsSince(&start);
 
-  while (1) {
-    int num_merges = 0;
+  markSteps++;
+  markStepTotal += took;
+  if (took > markStepLongest) markStepLongest = took;
+  return left;
+}
 
-    ArenaHeader * left = list;
-                  list = NULL;
-    ArenaHeader * tail = NULL;
+// Requires HeapLock. Started at the goal, enough marking per step to finish
+// before the heap grew past it by half the runway. The survivors of the last
+// GC estimate the live words.
+void startIncrementalMark() {
+  size_t runway = heapGoal > heapSurvivors ? heapGoal - heapSurvivors : 0;
+  if (runway < GC_ARENA_SIZE) runway = GC_ARENA_SIZE;
+  markWordsPerByte  = 2.0 * heapSurvivors / sizeof(void*) / runway;
+  markStepAllocated = allocatedSinceGc;
+  markSteps         = 0;
+  markStepLongest   = 0;
+  markStepTotal     = 0;
+}
 
-    while (left != NULL) {
-      num_merges++;
+// Requires HeapLock. Allocation driven step, returns 1 if grey objects are
+// left for the next one.
+int incrementalMarkStep() {
+  size_t allocated = allocatedSinceGc - markStepAllocated;
+  markStepAllocated = allocatedSinceGc;
+  size_t budget = (size_t)(allocated * markWordsPerByte);
+  if (budget < MIN_MARK_STEP_WORDS) budget = MIN_MARK_STEP_WORDS;
+  if (budget > MAX_MARK_STEP_WORDS) budget = MAX_MARK_STEP_WORDS;
+  return markStep(budget);
+}
 
-      ArenaHeader * right = left->next;
-      int left_bucket_size = 1;
+// Remark pause, the object in progress is rescanned as a whole
+void finishIncrementalMark() {
+  if (markSliceObject != NULL) {
+    stackPush(&MarkStack, markSliceObject);
+    markSliceObject = NULL;
+  }
+  if (gcReportingEnabled && markSteps > 0) {
+    printf("mark steps: %lu, longest took: %.0f us, average: %.0f us\n",
+        markSteps, markStepLongest * 1e6, markStepTotal * 1e6 / markSteps);
+  }
+  markSteps = 0;
+}
 
-      while (left_bucket_size < segmentation && right != NULL) {
-        left_bucket_size++;
-        right = right->next;
-      }
+int gcMarkStep(size_t budget) {
+  lockHeap();
+  int left = gcMarkingActive && !concurrentMarkingEnabled && markStep(budget);
+  unlockHeap();
+  return left;
+}
 
-      int right_bucket_size = segmentation;
+void gcEnableIncrementalMarking(int enable) {
+  lockHeap();
+  incrementalMarkingEnabled = enable;
+  if (!enable && gcMarkingActive && !concurrentMarkingEnabled) {
+    // Nobody would finish the cycle
+    doGc(1, 0);
+  }
+  unlockHeap();
+}
 
-      while (left_bucket_size > 0 ||
-             (right_bucket_size > 0 && right != NULL)) {
 
-        ArenaHeader * next = NULL;
-        if (right_bucket_size == 0 || right == NULL ||
-            (left_bucket_size > 0 &&
-             right->num_alloc < left->num_alloc)) {
-          next = left;
-          left = left->next;
-          left_bucket_size--;
-        } else {
-          next  = right;
-          right = right->next;
-          right_bucket_size--;
-        }
+/*
+ * Lazy sweeping
+ *
+ */
 
-        if (tail != NULL) {
-          tail->next = next;
-        } else {
-          list = next;
+void gcEnableLazySweeping(int enable) {
+  lockHeap();
+  lazySweepingEnabled = enable;
+  if (!enable) {
+    stopBackgroundSweeper();
+    backgroundSweepingEnabled = 0;
+  }
+  if (!enable && !gcMarkingActive) {
+    // Sweep what is left over, while marking concurrently the sweep after
+    // the remark does
+    for (int class = 0; class < NUM_CLASSES; class++) {
+      for (int i = 0; i < NUM_ARENA_SEGMENTS; i++) {
+        ArenaHeader * arena;
+        while ((arena = popSweepArena(class, i)) != NULL) {
+          if (lazySweepArena(arena)) pushFreeArena(arena);
         }
-        tail = next;
       }
-
-      left = right;
     }
-    tail->next = NULL;
+  }
+  unlockHeap();
+}
+
 
-    if (num_merges <= 1)
-      return list;
+/*
+ * Background sweeping
+ *
+ */
+
+static pthread_cond_t SweeperCond = PTHREAD_COND_INITIALIZER;
 
-    segmentation *= 2;
+// Protected by HeapLock
+static int sweeperStarted = 0;
+static int sweeperRunning = 0;
+static int sweeperStop    = 0;
+
+// Requires HeapLock. Takes the next arena the sweeper has to sweep.
+ArenaHeader * nextBackgroundSweepArena() {
+  for (int class = 0; class < NUM_CLASSES; class++) {
+    for (int i = 0; i < NUM_ARENA_SEGMENTS; i++) {
+      ArenaHeader * arena = popSweepArena(class, i);
+      if (arena != NULL) return arena;
+    }
   }
+  return NULL;
 }
 
-void gcSweep(int full_gc, int segment) {
-  int max_class = gcCurrentClass();
-  int release_variable_arenas = checkReleaseVariableArenas();
-  assert(max_class <= NUM_CLASSES && max_class > 0);
-  for (int class = 0; class < max_class; class++) {
-    for (int i = 0; i < NUM_HEAP_SEGMENTS; i++) {
-      if (i >= NUM_FIXED_HEAP_SEGMENTS && !release_variable_arenas) {
-        continue;
-      }
+// Not a mutator, thus takes HeapLock without parking at GC requests. The
+// arena being swept is in no list and only this thread touches it.
+void * backgroundSweeperLoop(void * arg) {
+  pthread_mutex_lock(&HeapLock);
+  while (1) {
+    while (!sweeperRunning) {
+      pthread_cond_wait(&SweeperCond, &HeapLock);
+    }
+    ArenaHeader * arena = sweeperStop ? NULL : nextBackgroundSweepArena();
+    if (arena == NULL) {
+      sweeperRunning = 0;
+      pthread_cond_broadcast(&SweeperCond);
+      continue;
+    }
+    pthread_mutex_unlock(&HeapLock);
 
-      ArenaHeader * arena     = Heap[class][i].free_arena;
-      ArenaHeader * last_free = NULL;
-      while (arena != NULL) {
-        if (full_gc || isSweepingCandidate(arena)) {
-          sweepArena(arena);
-          sweepingDone(arena);
-          // Release empty arenas
-          if (arena->num_alloc == 0) {
-            if (last_free != NULL) {
-              last_free->next = arena->next;
-            } else {
-              Heap[class][i].free_arena = arena->next;
-            }
-            ArenaHeader * to_free = arena;
-            arena = arena->next;
-            removeArena(to_free);
-            continue;
-          }
-        }
-        last_free = arena;
-        arena = arena->next;
-      }
-      arena = Heap[class][i].full_arena;
-      ArenaHeader * prev_full = NULL;
-      while (arena != NULL) {
-        if (full_gc || isSweepingCandidate(arena)) {
-          sweepArena(arena);
-          sweepingDone(arena);
-
-          // Release empty arenas
-          if (arena->num_alloc == 0) {
-            if (prev_full != NULL) {
-              prev_full->next = arena->next;
-            } else {
-              Heap[class][i].full_arena = arena->next;
-            }
-            ArenaHeader * to_free = arena;
-            arena = arena->next;
-            removeArena(to_free);
-            continue;
-          }
+    int has_marks = getLiveCount(arena) > 0;
+    int num_alloc = has_marks ? sweepArenaObjects(arena) : 0;
 
-          // Move arenas with empty space to the free_arena list
-          if (!isArenaConsideredFull(arena)) {
-            if (last_free != NULL) {
-              last_free->next = arena;
-            } else {
-              Heap[class][i].free_arena = arena;
-            }
-            last_free = arena;
-            if (prev_full == NULL) {
-              Heap[class][i].full_arena = arena->next;
-            } else {
-              prev_full->next = arena->next;
-            }
-            ArenaHeader * next = arena->next;
-            arena->next = NULL;
-            arena = next;
-            continue;
-          }
-        }
-        prev_full = arena;
-        arena = arena->next;
-      }
-      tryShrinkHeap(class, i);
+    pthread_mutex_lock(&HeapLock);
+    // Empty arenas are released right here
+    if (finishLazySweep(arena, has_marks, num_alloc)) {
+      pushFreeArena(arena);
+    }
+  }
+  return NULL;
+}
 
-      // Sort arenas according to num_alloc: this creates more full arenas
-      // (which do not have to be sweeped) since we first try to allocate in
-      // more populated arenas.
-      Heap[class][i].free_arena = sortFreeArenas(Heap[class][i].free_arena);
+// Requires HeapLock. Afterwards every arena is back in a list.
+void stopBackgroundSweeper() {
+  sweeperStop = 1;
+  while (sweeperRunning) {
+    pthread_cond_wait(&SweeperCond, &HeapLock);
+  }
+  sweeperStop = 0;
+}
+
+// Requires HeapLock
+void startBackgroundSweeper() {
+  if (!sweeperStarted) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, backgroundSweeperLoop, NULL)) {
+      fatalError("Could not start background sweeper thread");
     }
+    pthread_detach(thread);
+    sweeperStarted = 1;
   }
+  sweeperRunning = 1;
+  pthread_cond_broadcast(&SweeperCond);
 }
 
-unsigned int getDiff(struct timespec a, struct timespec b) {
-  if (a.tv_sec == b.tv_sec) {
-    return (b.tv_nsec - a.tv_nsec) / 100000;
+void gcEnableBackgroundSweeping(int enable) {
+  lockHeap();
+  if (enable) {
+    lazySweepingEnabled = 1;
   } else {
-    return (1000000000L - a.tv_nsec + b.tv_nsec +
-            (1000000000L * (b.tv_sec - a.tv_sec - 1))) / 100000;
+    stopBackgroundSweeper();
   }
+  backgroundSweepingEnabled = enable;
+  unlockHeap();
 }
 
-void gcForceRun() {
-  doGc(1, 0);
-}
 
-static unsigned long total_time = 0;
+/*
+ * Evacuation
+ *
+ */
 
-void doGc(int full_gc, int segment) {
-  updateMaxClass(full_gc);
+void gcPin(ObjectHeader * o) {
+  __atomic_fetch_add(&chunkFromPtr(o)->pins, 1, __ATOMIC_RELAXED);
+}
 
-  assert(gcCurrentClass() <= NUM_CLASSES);
+void gcUnpin(ObjectHeader * o) {
+  assert(chunkFromPtr(o)->pins > 0);
+  __atomic_fetch_sub(&chunkFromPtr(o)->pins, 1, __ATOMIC_RELAXED);
+}
 
-#ifdef DEBUG
-  verifyHeap();
-#endif
+int isEvacuationCandidate(ArenaHeader * arena) {
+  return arena->pins == 0 &&
+         getLiveCount(arena) < evacuationLiveFraction * getNumObjects(arena);
+}
 
-  if (gcReportingEnabled) {
-    printf("--- %s GC initiated [max_class %d]:\n",
-        full_gc ? "Full" : "Partial",
-        gcCurrentClass());
-    printMemoryStatistics();
+// Returns the next arena of the segment which evacuated objects can be
+// copied to, swept to make all its free cells available. The free bins are
+// visited from the fullest, *bin is the one target was taken from or -1 once
+// they ran out. From then on only new arenas are taken, the next of a new
+// arena is the head of bin 0 which was filled already.
+ArenaHeader * nextEvacuationTarget(int class, int segment,
+                                   ArenaHeader * target, int * bin) {
+  if (*bin >= 0) {
+    do {
+      if (target != NULL) {
+        target = target->next;
+      } else if (*bin > 0) {
+        target = Heap[class][segment].free_arena[--*bin];
+      } else {
+        break;
+      }
+    } while (target == NULL || target->evacuating);
+    if (target != NULL) {
+      target->needs_sweep = 0;
+      sweepArena(target);
+      return target;
+    }
   }
+  // Still better than leaving several sparse arenas around
+  *bin   = -1;
+  target = newArena(class, segment);
+  if (target == NULL) {
+    fatalError("Out of memory");
+  }
+  Heap[class][segment].size++;
+  return target;
+}
 
-  static struct timespec a, b, c, d;
-  if (gcReportingEnabled) clock_gettime(CLOCK_REALTIME, &a);
-
-  if (full_gc) {
-    stackReset(&MarkStack);
-    for (int class = 0; class < gcCurrentClass(); class++) {
-      for (int i = 0; i < NUM_HEAP_SEGMENTS; i++) {
-        ArenaHeader * arena = Heap[class][i].free_arena;
-        while (arena != NULL) {
-          clearAllMarks(arena);
-          arena = arena->next;
-        }
-        arena = Heap[class][i].full_arena;
-        while (arena != NULL) {
-          clearAllMarks(arena);
-          arena = arena->next;
-        }
+// The targets stay in the bin they were taken from while they are filled,
+// moves them to the bin matching their new population
+void rebinEvacuationTargets(int class, int segment) {
+  HeapStruct  * heap  = &Heap[class][segment];
+  ArenaHeader * moved = NULL;
+  for (int bin = 0; bin < FREE_ARENA_BINS; bin++) {
+    ArenaHeader ** prev = &heap->free_arena[bin];
+    while (*prev != NULL) {
+      ArenaHeader * arena = *prev;
+      if (getFreeArenaBin(arena) != bin) {
+        *prev       = arena->next;
+        arena->next = moved;
+        moved       = arena;
+      } else {
+        prev = &arena->next;
       }
     }
   }
+  while (moved != NULL) {
+    ArenaHeader * arena = moved;
+    moved = arena->next;
+    pushFreeArena(arena);
+  }
+}
 
-  if (gcReportingEnabled) clock_gettime(CLOCK_REALTIME, &b);
-  gcMarkWrapper();
-#ifdef DEBUG
-  verifyHeap();
-#endif
-  if (gcReportingEnabled) clock_gettime(CLOCK_REALTIME, &c);
-  gcSweep(full_gc, segment);
-  if (gcReportingEnabled) clock_gettime(CLOCK_REALTIME, &d);
+// The first word of an evacuated object points to its copy
+#define _UPDATE_CHILD(child, _) \
+  if (child != NULL && chunkFromPtr(child)->evacuating) { \
+    child = *(ObjectHeader**)child; \
+  }
 
-#ifdef DEBUG
-  verifyHeap();
-#endif
+void updateArenaReferences(ArenaHeader * arena) {
+  ObjectHeader * o = (ObjectHeader*)getArenaFirst(arena);
+  while ((uintptr_t)o < getArenaTop(arena) &&
+         (uintptr_t)o < getArenaEnd(arena)) {
+    if (!isMarkWhite(o)) {
+      DO_CHILDREN(o, _UPDATE_CHILD, NULL);
+    }
+    nextObject(&o, arena);
+  }
+}
 
-  if (gcReportingEnabled) {
-    total_time += getDiff(a,d) / 10;
-    if (full_gc) {
-      printf("clearing mark bits took: %d 10ms\n", getDiff(a, b));
+size_t releaseEvacuatedArenas(ArenaHeader ** list) {
+  size_t reclaimed = 0;
+  while (*list != NULL) {
+    ArenaHeader * arena = *list;
+    if (arena->evacuating) {
+      *list = arena->next;
+      reclaimed += getRealPageSizeFromArena(arena);
+      Heap[arena->gc_class][arena->segment].alloc_count -= arena->num_alloc;
+      removeArena(arena);
+    } else {
+      list = &arena->next;
     }
-    printf("marking took: %d 10ms\n", getDiff(b, c));
-    printf("sweeping took: %d 10ms\n", getDiff(c, d));
-    printf("total: %lu ms\n", total_time);
-    printMemoryStatistics();
   }
+  return reclaimed;
 }
 
-void gcInit() {
-  assert(heapInitNumArena > 0);
+// Requires a stopped world after a full marking. Copies the survivors of
+// sparse fixed size arenas into denser arenas of the same segment, then
+// releases the sparse ones. Returns the number of bytes released.
+size_t evacuateSparseArenas() {
+  int evacuated = 0;
   for (int class = 0; class < NUM_CLASSES; class++) {
-    for (int i = 0; i < NUM_HEAP_SEGMENTS; i++) {
-      Heap[class][i].free_arena      = NULL;
-      Heap[class][i].full_arena      = NULL;
-      if (i < NUM_FIXED_HEAP_SEGMENTS) {
-        Heap[class][i].size_limit    = heapInitNumArena;
-      } else {
-        Heap[class][i].size_limit    = heapInitNumVarArena;
+    for (int i = 0; i < NUM_FIXED_HEAP_SEGMENTS; i++) {
+      int candidates = 0;
+      ArenaHeader * lists[NUM_ARENA_LISTS];
+      getArenaLists(&Heap[class][i], lists);
+      for (int l = 0; l < NUM_ARENA_LISTS; l++) {
+        for (ArenaHeader * a = lists[l]; a != NULL; a = a->next) {
+          if (isEvacuationCandidate(a)) {
+            a->evacuating = 1;
+            candidates++;
+          }
+        }
       }
-      Heap[class][i].size            = 0;
+      if (candidates < 2 && (candidates == 0 ||
+                             Heap[class][i].size == candidates)) {
+        // Nothing to gain from moving a single arena into a new one
+        for (int l = 0; l < NUM_ARENA_LISTS; l++) {
+          for (ArenaHeader * a = lists[l]; a != NULL; a = a->next) {
+            a->evacuating = 0;
+          }
+        }
+        continue;
+      }
+      evacuated += candidates;
     }
   }
 
-  assert(1<<((int)log2(SMALLEST_SEGMENT_SIZE)) == SMALLEST_SEGMENT_SIZE);
-  //assert(SMALLEST_SEGMENT_SIZE >= sizeof(ObjectHeader));
-  //assert(SMALLEST_SEGMENT_SIZE <= (1<<(1+(int)log2(sizeof(ObjectHeader)))));
+  ObjectHeader * root;
+  while ((root = stackPop(&RootPins)) != NULL) {
+    chunkFromPtr(root)->pins--;
+  }
 
-  buildGcSegmentSizeLookupTable();
+  for (int class = 0; class < NUM_CLASSES && evacuated > 0; class++) {
+    for (int i = 0; i < NUM_FIXED_HEAP_SEGMENTS; i++) {
+      ArenaHeader * target = NULL;
+      int           bin    = FREE_ARENA_BINS;
+      // New targets are added in front of a free bin, thus the lists
+      // are iterated from their current heads
+      ArenaHeader * lists[NUM_ARENA_LISTS];
+      getArenaLists(&Heap[class][i], lists);
+      for (int l = 0; l < NUM_ARENA_LISTS; l++) {
+        for (ArenaHeader * a = lists[l]; a != NULL; a = a->next) {
+          if (!a->evacuating) continue;
+          ObjectHeader * o = (ObjectHeader*)getArenaFirst(a);
+          while ((uintptr_t)o < (uintptr_t)a->free &&
+                 (uintptr_t)o < getArenaEnd(a)) {
+            if (!isMarkWhite(o)) {
+              ObjectHeader * copy;
+              while (target == NULL ||
+                     (copy = allocFromArena(target)) == NULL) {
+                target = nextEvacuationTarget(class, i, target, &bin);
+              }
+              memcpy(copy, o, getObjectSize(a));
+              Heap[class][i].used_bytes += getObjectSize(a);
+              countLiveObject(copy, 0);
+              setMarkBlack(copy);
+              *(ObjectHeader**)o = copy;
+            }
+            nextObject(&o, a);
+          }
+        }
+      }
+    }
+  }
 
-  MarkStack = allocStackChunk();
-}
+  if (evacuated == 0) {
+    return 0;
+  }
 
-void gcTeardown() {
-  doGc(1, 0);
   for (int class = 0; class < NUM_CLASSES; class++) {
     for (int i = 0; i < NUM_HEAP_SEGMENTS; i++) {
-      ArenaHeader * arena = Heap[class][i].free_arena;
-      while (arena != NULL) {
-        ArenaHeader * next = arena->next;
-        removeArena(arena);
-        arena = next;
-      }
-      arena = Heap[class][i].full_arena;
-      while (arena != NULL) {
-        ArenaHeader * next = arena->next;
-        removeArena(arena);
-        arena = next;
+      ArenaHeader * lists[NUM_ARENA_LISTS];
+      getArenaLists(&Heap[class][i], lists);
+      for (int l = 0; l < NUM_ARENA_LISTS; l++) {
+        for (ArenaHeader * a = lists[l]; a != NULL; a = a->next) {
+          if (!a->evacuating) updateArenaReferences(a);
+        }
       }
-      if (i < NUM_FIXED_HEAP_SEGMENTS) {
-        assert(Heap[class][i].size == 0);
+    }
+  }
+
+  size_t reclaimed = 0;
+  for (int class = 0; class < NUM_CLASSES; class++) {
+    for (int i = 0; i < NUM_FIXED_HEAP_SEGMENTS; i++) {
+      for (int l = 0; l < NUM_ARENA_LISTS; l++) {
+        reclaimed += releaseEvacuatedArenas(getArenaList(&Heap[class][i], l));
       }
+      rebinEvacuationTargets(class, i);
     }
   }
+
+  return reclaimed;
 }
 
 
@@ -1073,39 +3485,66 @@ void _verifyChild(ObjectHeader * child, ObjectHeader * parent) {
   assert((long)child != kGcZapPointer);
   ArenaHeader * child_arena = chunkFromPtr(child);
   assert(child_arena->num_alloc > 0);
-  if (*getMark(parent) == BLACK_MARK) assert(*getMark(child) != WHITE_MARK);
+#ifndef USE_MARK_BITMAP
+  if (isMarkBlack(parent)) assert(!isMarkWhite(child));
+#else
+  // Marked objects might still be waiting on a mark stack
+  if (isMarkBlack(parent) && stackEmpty(MarkStack)) {
+    assert(!isMarkWhite(child));
+  }
+#endif
 #endif
 }
 
 void verifyArena(ArenaHeader * arena) {
 #ifdef VERIFY_HEAP
   ObjectHeader * o    = (ObjectHeader*)getArenaFirst(arena);
-  char *         mark = getBytemap(arena);
+  unsigned int   live = 0;
+  // Line arenas: the next line starting an object or a free run
+  int            span = 0;
   while((uintptr_t)o < getArenaEnd(arena) &&
-        (uintptr_t)o < (uintptr_t)arena->free) {
-    assert(getMark(o) == mark);
-    if (*mark != WHITE_MARK) {
+        (uintptr_t)o < getArenaTop(arena)) {
+    int starts = 1;
+    if (arena->segment == LINE_SEGMENT) {
+      int line = getLineIndex(o, arena);
+      starts   = line == span;
+      if (starts) span += getLineSpans(arena)[line];
+      assert(span > line);
+    }
+    if (!isMarkWhite(o)) {
+      assert(starts);
+#ifdef USE_CARD_MARKING
+      // Stores into marked parents are only recorded in the card table
+      if (!isObjectDirty(o))
+#endif
       DO_CHILDREN(o, _VERIFY_CHILD, o);
+      live += getObjectCells(o, arena);
     }
     nextObject(&o, arena);
-    mark++;
   }
+  assert(arena->segment != LINE_SEGMENT || span == getNumObjects(arena));
+  assert(live == getLiveCount(arena));
 #endif
 }
 
 void verifyHeap() {
   for (int class = 0; class < NUM_CLASSES; class++) {
     for (int i = 0; i < NUM_HEAP_SEGMENTS; i++) {
-      ArenaHeader * arena = Heap[class][i].free_arena;
-      while (arena != NULL) {
-        verifyArena(arena);
-        arena = arena->next;
-      }
-      arena = Heap[class][i].full_arena;
-      while (arena != NULL) {
-        verifyArena(arena);
-        arena = arena->next;
+      size_t used = 0;
+      for (int l = 0; l < NUM_ARENA_LISTS; l++) {
+        ArenaHeader * arena = *getArenaList(&Heap[class][i], l);
+        while (arena != NULL) {
+          verifyArena(arena);
+          used += (size_t)arena->num_alloc * getObjectSize(arena);
+          assert(i < NUM_ARENA_SEGMENTS ||
+                 LargeObjects[class].arena[arena->large_index] == arena);
+          assert(i < NUM_ARENA_SEGMENTS ||
+                 (LargeObjects[class].epoch[arena->large_index] ==
+                  gcMarkEpoch) == (getLiveCount(arena) > 0));
+          arena = arena->next;
+        }
       }
+      assert(used == Heap[class][i].used_bytes);
     }
   }
 }
@@ -1115,14 +3554,15 @@ void inspectArena(ArenaHeader * arena) {
   printf("  object_size  : %d\n", getObjectSize(arena));
   printf("  num_objects  : %d\n", getNumObjects(arena));
   printf("  mark_bits    : [");
-  char * bm    = getBytemap(arena);
+  ObjectHeader * o = (ObjectHeader*)getArenaFirst(arena);
   int    count = 0;
   int    col   = 0;
   int    total = 0;
   for (int i = 0; i < getNumObjects(arena); i++) {
-    if (bm[i] != 0) {
+    if (!isMarkWhite(o)) {
       count++;
     }
+    nextObject(&o, arena);
     if (i % 512 == 511) {
       printf("%4i", count);
       total += count;
@@ -1139,55 +3579,55 @@ void inspectArena(ArenaHeader * arena) {
 }
 
 int getNumberOfMarkBits(ArenaHeader * arena) {
-  char * bm    = getBytemap(arena);
   int    count = 0;
+#ifndef USE_MARK_BITMAP
+  char * bm    = getBytemap(arena);
   for (int i = 0; i < getNumObjects(arena); i++) {
     if (bm[i] != 0) {
       count++;
     }
   }
+#else
+  MarkWord * word  = (MarkWord*)getBytemap(arena);
+  int        words = getMarkMapSize(getNumObjects(arena)) / sizeof(MarkWord);
+  for (int w = 0; w < words; w++) {
+    count += __builtin_popcountll(word[w]);
+  }
+#endif
   return count;
 }
 
+int countHugePageArenas();
+
 void printMemoryStatistics() {
+  printf("Pooled empty arenas: %d\n", arenaPoolSize);
+  if (hugePagesEnabled) {
+    printf("Arenas with huge pages: %d\n", countHugePageArenas());
+  }
   for (int class = 0; class < 1; class++) {
     unsigned long space  = 0;
     unsigned long usable = 0;
     unsigned long used   = 0;
     printf("[%d] Fixed space:\n", class);
-    for (int i = 0; i < NUM_FIXED_HEAP_SEGMENTS; i++) {
+    for (int i = 0; i < NUM_ARENA_SEGMENTS; i++) {
       int full_arenas      = 0;
       int free_arenas      = 0;
       float population     = 0;
-      ArenaHeader * arena = Heap[class][i].free_arena;
-      while (arena != NULL) {
-        space  += getRealPageSizeFromArena(arena);
-        space  += stackSize(arena->free_list);
-        usable += getNumObjects(arena) * getObjectSize(arena);
-        used   += arena->num_alloc * getObjectSize(arena);
-        if (isArenaConsideredFull(arena)) {
-          full_arenas++;
-        } else {
-          free_arenas++;
-          population += (float)arena->num_alloc /
-                        (float)getNumObjects(arena);
-        }
-        arena   = arena->next;
-      }
-      arena = Heap[class][i].full_arena;
-      while (arena != NULL) {
-        space  += getRealPageSizeFromArena(arena);
-        space  += stackSize(arena->free_list);
-        usable += getNumObjects(arena) * getObjectSize(arena);
-        used   += arena->num_alloc * getObjectSize(arena);
-        if (isArenaConsideredFull(arena)) {
-          full_arenas++;
-        } else {
-          free_arenas++;
-          population += (float)arena->num_alloc /
-                        (float)getNumObjects(arena);
+      for (int l = 0; l < NUM_ARENA_LISTS; l++) {
+        ArenaHeader * arena = *getArenaList(&Heap[class][i], l);
+        while (arena != NULL) {
+          space  += getRealPageSizeFromArena(arena);
+          usable += getNumObjects(arena) * getObjectSize(arena);
+          used   += arena->num_alloc * getObjectSize(arena);
+          if (isArenaConsideredFull(arena)) {
+            full_arenas++;
+          } else {
+            free_arenas++;
+            population += (float)arena->num_alloc /
+                          (float)getNumObjects(arena);
+          }
+          arena   = arena->next;
         }
-        arena   = arena->next;
       }
       if (free_arenas > 0 || full_arenas > 0) {
         printf("     [%d] %d arenas average %0.2f, (used %f), %d arenas full\n",
@@ -1203,24 +3643,17 @@ void printMemoryStatistics() {
     space  = 0;
     usable = 0;
     used   = 0;
-    for (int i = NUM_FIXED_HEAP_SEGMENTS;
-         i < NUM_FIXED_HEAP_SEGMENTS+NUM_VARIABLE_HEAP_SEGMENTS;
+    for (int i = NUM_ARENA_SEGMENTS;
+         i < NUM_HEAP_SEGMENTS;
          i++) {
-      ArenaHeader * arena = Heap[class][i].free_arena;
-      while (arena != NULL) {
-        space  += getRealPageSizeFromArena(arena);
-        space  += stackSize(arena->free_list);
-        usable += getNumObjects(arena) * getObjectSize(arena);
-        used   += arena->num_alloc * getObjectSize(arena);
-        arena   = arena->next;
-      }
-      arena = Heap[class][i].full_arena;
-      while (arena != NULL) {
-        space  += getRealPageSizeFromArena(arena);
-        space  += stackSize(arena->free_list);
-        usable += getNumObjects(arena) * getObjectSize(arena);
-        used   += arena->num_alloc * getObjectSize(arena);
-        arena   = arena->next;
+      for (int l = 0; l < NUM_ARENA_LISTS; l++) {
+        ArenaHeader * arena = *getArenaList(&Heap[class][i], l);
+        while (arena != NULL) {
+          space  += getRealPageSizeFromArena(arena);
+          usable += getNumObjects(arena) * getObjectSize(arena);
+          used   += arena->num_alloc * getObjectSize(arena);
+          arena   = arena->next;
+        }
       }
     }
     printf("[%d] Large Vectors: Reserverd: %lu mb | Usable: %lu mb | Used: %lu mb\n",
@@ -1229,6 +3662,127 @@ void printMemoryStatistics() {
 }
 
 
+/*
+ * Huge pages
+ *
+ */
+
+void gcEnableHugePages(int enable) {
+  assert(GC_ARENA_ALIGNMENT % GC_HUGE_PAGE_SIZE == 0);
+  lockHeap();
+  hugePagesEnabled = enable;
+  unlockHeap();
+}
+
+// Huge page bytes smaps attributes to an arena
+typedef struct ArenaRange ArenaRange;
+struct ArenaRange {
+  uintptr_t start;
+  uintptr_t end;
+  size_t    huge;
+};
+
+int compareArenaRanges(const void * a, const void * b) {
+  uintptr_t x = ((ArenaRange*)a)->start;
+  uintptr_t y = ((ArenaRange*)b)->start;
+  return x < y ? -1 : x > y;
+}
+
+// Ranges are sorted and disjoint
+void attributeHugePages(ArenaRange * ranges, int num, uintptr_t from,
+                        uintptr_t to, size_t bytes) {
+  int lo = 0;
+  int hi = num;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (ranges[mid].end <= from) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  for (int r = lo; r < num && ranges[r].start < to && bytes > 0; r++) {
+    uintptr_t start   = ranges[r].start > from ? ranges[r].start : from;
+    uintptr_t end     = ranges[r].end < to ? ranges[r].end : to;
+    size_t    overlap = end - start;
+    size_t    take    = overlap < bytes ? overlap : bytes;
+    ranges[r].huge += take;
+    bytes          -= take;
+  }
+}
+
+// Arenas with at least one huge page, -1 if unknown. smaps only has the
+// totals of every mapping and adjacent arenas merge into one mapping, thus
+// the huge pages of a mapping are attributed to its arenas in address
+// order, each taking at most its size. Exact if every arena is a mapping of
+// its own. Requires HeapLock.
+int countHugePageArenas() {
+  FILE * smaps = fopen("/proc/self/smaps", "r");
+  if (smaps == NULL) return -1;
+
+  int num = 0;
+  for (int class = 0; class < NUM_CLASSES; class++) {
+    for (int i = 0; i < NUM_HEAP_SEGMENTS; i++) {
+      for (int l = 0; l < NUM_ARENA_LISTS; l++) {
+        ArenaHeader * arena = *getArenaList(&Heap[class][i], l);
+        for (; arena != NULL; arena = arena->next) num++;
+      }
+    }
+  }
+  ArenaRange * ranges = malloc((num + 1) * sizeof(ArenaRange));
+  if (ranges == NULL) {
+    fclose(smaps);
+    return -1;
+  }
+  int r = 0;
+  for (int class = 0; class < NUM_CLASSES; class++) {
+    for (int i = 0; i < NUM_HEAP_SEGMENTS; i++) {
+      for (int l = 0; l < NUM_ARENA_LISTS; l++) {
+        ArenaHeader * arena = *getArenaList(&Heap[class][i], l);
+        for (; arena != NULL; arena = arena->next) {
+          ranges[r].start = (uintptr_t)getRealPageStart(arena);
+          ranges[r].end   = ranges[r].start +
+                            getRealPageSizeFromArena(arena);
+          ranges[r].huge  = 0;
+          r++;
+        }
+      }
+    }
+  }
+  qsort(ranges, num, sizeof(ArenaRange), compareArenaRanges);
+
+  uintptr_t start = 0;
+  uintptr_t end   = 0;
+  char      line[256];
+  while (fgets(line, sizeof(line), smaps) != NULL) {
+    unsigned long from, to, kb;
+    if (sscanf(line, "%lx-%lx ", &from, &to) == 2) {
+      start = from;
+      end   = to;
+    } else if ((sscanf(line, "AnonHugePages: %lu kB", &kb) == 1 ||
+                sscanf(line, "Private_Hugetlb: %lu kB", &kb) == 1) &&
+               kb > 0) {
+      attributeHugePages(ranges, num, start, end, kb << 10);
+    }
+  }
+  fclose(smaps);
+
+  int count = 0;
+  for (r = 0; r < num; r++) {
+    if (ranges[r].huge >= GC_HUGE_PAGE_SIZE) count++;
+  }
+  free(ranges);
+  return count;
+}
+
+int gcCountHugePageArenas() {
+  lockHeap();
+  int count = countHugePageArenas();
+  unlockHeap();
+  return count;
+}
+
+
 /* utils */
 
 void fatalError(const char * msg) {
@@ -22,18 +22,53 @@ void fatalError(const char * msg);
 
 /* structs */
 
+#define GC_ARENA_ALIGN_BITS 22
+#define GC_ARENA_ALIGNMENT  (1<<GC_ARENA_ALIGN_BITS)
+#define GC_ARENA_SIZE       GC_ARENA_ALIGNMENT
+#define GC_ARENA_ALIGN_MASK (GC_ARENA_ALIGNMENT-1)
+
+#ifdef USE_CARD_MARKING
+// One card per 512 bytes of an arena, large arenas have as many as they span
+#define GC_CARD_BITS 9
+#define GC_NUM_CARDS (1<<(GC_ARENA_ALIGN_BITS-GC_CARD_BITS))
+#endif
+
+// Bit of ArenaHeader.live_count the mark epoch starts at
+#define LIVE_EPOCH_SHIFT 32
+
 struct ArenaHeader {
-  unsigned char object_bits;
+  unsigned int  object_recip;
   unsigned int  first_offset;
   unsigned char segment;
   unsigned char gc_class;
   size_t        object_size;
   unsigned int  num_objects;
   unsigned int  num_alloc;
+  // Objects (in line arenas their lines) marked in the mark epoch kept in
+  // the upper half. Counts of an older epoch read as 0, the first mark of
+  // an epoch resets them. Only the thread turning a mark from white counts.
+  unsigned long live_count;
   void *        free;
-  StackChunk *  free_list;
+  // Line arenas: end of the free line run free bumps into
+  void *        limit;
+  // Line arenas: at least the lines of the longest free run
+  unsigned int  longest_run;
+  ObjectHeader * free_list;
   char          was_full;
+  char          promoted;
+  char          evacuating;
+  unsigned int  pins;
+  unsigned long idle_since;
+  char          needs_sweep;
   ArenaHeader * next;
+  // Large arenas: the one before in their list and their large object slot
+  ArenaHeader * prev;
+  unsigned int  large_index;
+#ifdef USE_CARD_MARKING
+  // Lies in the arena after the marks (and line spans)
+  unsigned char * cards;
+  unsigned int  num_cards;
+#endif
 };
 
 
@@ -60,16 +95,84 @@ void gcForward(ObjectHeader * object);
 
 void gcEnableReporting(int i);
 
+// Threads marking, sweeping and clearing the marks in a GC pause
+void gcSetMarkThreads(int num);
+
+// Sweep kernel for the mark bytemap. GC_SWEEP_AUTO (the default) picks the
+// widest one the CPU supports. Returns 0 if the kernel is not supported.
+#define GC_SWEEP_AUTO   0
+#define GC_SWEEP_SCALAR 1
+#define GC_SWEEP_SSE2   2
+#define GC_SWEEP_AVX2   3
+int gcSetSweepKernel(int kernel);
+
+// Full GCs mark in a background thread, the mutator only stops for the
+// initial (roots) and the final remark pause.
+void gcEnableConcurrentMarking(int enable);
+
+// Full GCs mark in steps from the allocation slow path, in proportion to the
+// allocation, the mutator only stops for the initial and the remark pause.
+// Combine with lazy sweeping to also keep the sweeping out of the remark.
+void gcEnableIncrementalMarking(int enable);
+
+// Marks up to budget words of grey objects of the running incremental cycle,
+// e.g. while idle. Returns 1 if grey objects are left.
+int gcMarkStep(size_t budget);
+
+// GCs only flag arenas, the allocator sweeps them when it needs free cells
+void gcEnableLazySweeping(int enable);
+
+// Flagged arenas are also swept by a background thread while the mutator
+// runs, which releases the empty ones. Enables lazy sweeping.
+void gcEnableBackgroundSweeping(int enable);
+
+// Full GC which also moves the survivors of sparse arenas into denser ones.
+// Objects referenced by roots (forwarded in gcMarkWrapper) or pinned do not
+// move; any other heap pointer held outside of the heap becomes invalid.
+void gcCompact();
+void gcPin(ObjectHeader * o);
+void gcUnpin(ObjectHeader * o);
+
+// New arenas are backed by huge pages (hugetlb if reserved, else THP) if
+// the system supports it
+void gcEnableHugePages(int enable);
+int  gcCountHugePageArenas();
+
+// The heap may grow to the live size after the last full GC plus percent
+// (default 75) before the next GC. A non-zero target instead sets the heap
+// size to collect at, as long as the live data leaves enough room below it.
+void gcSetHeapGrowth(int percent);
+void gcSetHeapTarget(size_t bytes);
+
+// Up to max_arenas empty arenas are kept mapped for reuse and released
+// once they were not needed for max_age GCs
+void gcSetArenaPool(int max_arenas, int max_age);
+
+// Up to max_bytes (default 512 MB) of address space of freed objects larger
+// than 1 MB is kept for reuse by objects of about the same size, released
+// once not needed for max_age (default 16) GCs. Their memory is returned to
+// the OS right away.
+void gcSetLargeMappingCache(size_t max_bytes, int max_age);
+
+// Every thread calling gcAlloc has to be registered. gcInit registers the
+// calling thread. Registered threads have to reach a safepoint (gcAlloc slow
+// path, gcSafepoint or gcUnregisterThread) for a GC to proceed.
+void gcRegisterThread();
+void gcUnregisterThread();
+void gcSafepoint();
+
 /* Inlined access functions */
 
+// Incremented by every full GC, see the bytemap marks below
+extern unsigned char gcMarkEpoch;
+
 #define WHITE_MARK ((char)0)
-#define GREY_MARK  ((char)1)
-#define BLACK_MARK ((char)2)
+#define GREY_MARK  ((char)(gcMarkEpoch * 2))
+#define BLACK_MARK ((char)(gcMarkEpoch * 2 + 1))
 
-#define GC_ARENA_ALIGN_BITS 22
-#define GC_ARENA_ALIGNMENT  (1<<GC_ARENA_ALIGN_BITS)
-#define GC_ARENA_SIZE       GC_ARENA_ALIGNMENT
-#define GC_ARENA_ALIGN_MASK (GC_ARENA_ALIGNMENT-1)
+inline int isWhiteMark(char mark) {
+  return (char)(mark | 1) != BLACK_MARK;
+}
 
 inline char * getBytemap(ArenaHeader * base) {
   return (char*)(base + 1);
@@ -80,8 +183,8 @@ inline ArenaHeader * chunkFromPtr(void * base) {
   return (ArenaHeader*) ((uintptr_t)base);
 }
 
-inline int getObjectBits(ArenaHeader * arena) {
-  return arena->object_bits;
+inline unsigned int getObjectRecip(ArenaHeader * arena) {
+  return arena->object_recip;
 }
 
 inline uintptr_t getArenaFirst(ArenaHeader * arena) {
@@ -89,9 +192,17 @@ inline uintptr_t getArenaFirst(ArenaHeader * arena) {
 }
 
 inline int getBytemapIndex(void * base, ArenaHeader * arena) {
-  return (((uintptr_t)base - getArenaFirst(arena)) >> getObjectBits(arena));
+  // Sizes are not powers of two, divide by multiplying with the reciprocal
+  return (((uint64_t)((uintptr_t)base - getArenaFirst(arena)) *
+           getObjectRecip(arena)) >> 32);
 }
 
+#ifndef USE_MARK_BITMAP
+
+// One mark byte per object. Grey and black are tagged with the current mark
+// epoch and marks of older epochs count as white, thus a full GC starts a
+// new epoch instead of clearing the bytemaps.
+
 inline char * getMark(void * ptr) {
   ArenaHeader * arena = chunkFromPtr(ptr);
   char *        bm    = getBytemap(arena);
@@ -99,10 +210,106 @@ inline char * getMark(void * ptr) {
   return bm + idx;
 }
 
+inline int isMarkWhite(void * ptr) {
+  return isWhiteMark(*getMark(ptr));
+}
+
+inline int isMarkBlack(void * ptr) {
+  return *getMark(ptr) == BLACK_MARK;
+}
+
+inline void setMarkGrey(void * ptr) {
+  *getMark(ptr) = GREY_MARK;
+}
+
+inline void setMarkBlack(void * ptr) {
+  *getMark(ptr) = BLACK_MARK;
+}
+
+#else
+
+// One mark bit per object. Grey objects are marked objects on a mark stack,
+// thus grey and black are indistinguishable.
+
+typedef uint64_t MarkWord;
+
+#define MARK_WORD_BITS 64
+
+inline MarkWord * getMarkWord(void * ptr) {
+  ArenaHeader * arena = chunkFromPtr(ptr);
+  unsigned int  idx   = getBytemapIndex(ptr, arena);
+  return (MarkWord*)getBytemap(arena) + idx / MARK_WORD_BITS;
+}
+
+inline MarkWord getMarkBit(void * ptr) {
+  unsigned int idx = getBytemapIndex(ptr, chunkFromPtr(ptr));
+  return (MarkWord)1 << (idx % MARK_WORD_BITS);
+}
+
+inline int isMarkWhite(void * ptr) {
+  return (*getMarkWord(ptr) & getMarkBit(ptr)) == 0;
+}
+
+inline int isMarkBlack(void * ptr) {
+  return !isMarkWhite(ptr);
+}
+
+// Neighbouring bits might be set concurrently
+inline void setMarkGrey(void * ptr) {
+  __atomic_fetch_or(getMarkWord(ptr), getMarkBit(ptr), __ATOMIC_RELAXED);
+}
+
+inline void setMarkBlack(void * ptr) {
+  setMarkGrey(ptr);
+}
+
+#endif
+
+// Set during a concurrent marking cycle
+extern int gcMarkingActive;
+
+#ifdef USE_CARD_MARKING
+
+// Slots of large objects might lie past the first aligned block, thus the
+// arena is the one of the parent
+inline unsigned char * getCard(ArenaHeader * arena, void * ptr) {
+  return arena->cards + (((uintptr_t)ptr - (uintptr_t)arena) >> GC_CARD_BITS);
+}
+
 inline void gcWriteBarrier(ObjectHeader * parent, ObjectHeader * child) {
-  if (*getMark(parent) == BLACK_MARK && *getMark(child) == WHITE_MARK) {
+  // The slot is unknown, thus all cards of the parent get dirty. The
+  // collector rescans the children of marked objects on dirty cards.
+  ArenaHeader *   arena = chunkFromPtr(parent);
+  unsigned char * first = getCard(arena, parent);
+  unsigned char * last  = getCard(arena, (char*)CHILD_SLOT(parent,
+                                                    NUM_CHILDREN(parent)) - 1);
+  memset(first, 1, last - first + 1);
+}
+
+// After storing a child into slot of parent. Only the card of the slot gets
+// dirty, stores into a huge vector rescan 512 bytes of it.
+inline void gcWriteBarrierSlot(ObjectHeader * parent, void * slot) {
+  *getCard(chunkFromPtr(parent), slot) = 1;
+}
+
+#else
+
+inline void gcWriteBarrier(ObjectHeader * parent, ObjectHeader * child) {
+  // Marks are sticky between full GCs, thus a black parent is old and the
+  // mark buffers double as the remembered set: partial GCs only trace from
+  // the roots and the remembered parents.
+  // While marking concurrently the parent might be scanned right now, thus
+  // any parent of a white child is rescanned in the remark pause.
+  if (isMarkWhite(child) && (isMarkBlack(parent) || gcMarkingActive)) {
     gcForward(parent);
   }
 }
 
+// After storing a child into slot of parent
+inline void gcWriteBarrierSlot(ObjectHeader * parent, void * slot) {
+  gcWriteBarrier(parent, *(ObjectHeader**)slot);
+}
+
+#endif
+
 #endif
@@ -12,4 +12,16 @@ typedef struct TestObject {
     action((((TestObject**)(p+1))[i]), arg); \
   }
 
+// Incremental marking scans large objects in slices of children
+#define NUM_CHILDREN(p) ((p)->length)
+
+#define DO_CHILDREN_RANGE(p, from, to, action, arg) \
+  for(long i = (from); i < (to); i++) { \
+    action((((TestObject**)(p+1))[i]), arg); \
+  }
+
+// Children are consecutive pointers, card marking maps slot addresses back
+// to ranges of children
+#define CHILD_SLOT(p, i) (((TestObject**)((p)+1)) + (i))
+
 #endif
@@ -1,9 +1,52 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <pthread.h>
 
 #include "object.h"
 #include "debugging.h"
 
+// Each mutator thread builds and verifies its own trees below Root
+#ifndef MUTATOR_THREADS
+#define MUTATOR_THREADS 1
+#endif
+
+#ifndef TREE_DEPTH
+#define TREE_DEPTH 5
+#endif
+
+#ifndef MARK_THREADS
+#define MARK_THREADS 1
+#endif
+
+#ifndef CONCURRENT_MARKING
+#define CONCURRENT_MARKING 0
+#endif
+
+#ifndef INCREMENTAL_MARKING
+#define INCREMENTAL_MARKING 0
+#endif
+
+#ifndef LAZY_SWEEPING
+#define LAZY_SWEEPING 0
+#endif
+
+#ifndef BACKGROUND_SWEEPING
+#define BACKGROUND_SWEEPING 0
+#endif
+
+#ifndef EVACUATION
+#define EVACUATION 0
+#endif
+
+#ifndef HUGE_PAGES
+#define HUGE_PAGES 0
+#endif
+
+// In MB, 0 uses the default heap growth
+#ifndef HEAP_TARGET
+#define HEAP_TARGET 0
+#endif
+
 static TestObject * Nil;
 static TestObject * Root;
 
@@ -30,14 +73,27 @@ TestObject * _alloc(int size) {
 void gcInit() {
   GC_INIT();
 }
+void gcSetMarkThreads(int n) {}
+void gcEnableConcurrentMarking(int e) {}
+void gcEnableIncrementalMarking(int e) {}
+void gcEnableLazySweeping(int e) {}
+void gcEnableBackgroundSweeping(int e) {}
+void gcCompact() {}
+void gcEnableHugePages(int e) {}
+void gcSetHeapTarget(size_t b) {}
+void gcPin(TestObject * o) {}
 void gcTeardown() {}
+void gcRegisterThread() {}
+void gcUnregisterThread() {}
 void gcWriteBarrier(TestObject * a, TestObject * b) {}
+void gcWriteBarrierSlot(TestObject * a, void * slot) {}
 
 #endif
 
 void setSlot(TestObject * parent, int index, TestObject * child) {
-  ((TestObject**)(parent+1))[index] = child;
-  gcWriteBarrier(parent, child);
+  TestObject ** slot = ((TestObject**)(parent+1)) + index;
+  *slot = child;
+  gcWriteBarrierSlot(parent, slot);
 }
 
 TestObject * getSlot(TestObject * parent, int index) {
@@ -113,34 +169,69 @@ void verifyTree(TestObject * node, TestObject * parent, long round) {
   }
 }
 
+static const int rounds = 10;
+static const int depth  = TREE_DEPTH;
+
+void * mutator(void * arg) {
+  long thread = (long)arg;
+  if (thread > 0) gcRegisterThread();
+
+  for (int i = 0; i < rounds; i++) {
+    int slot = thread * rounds + i;
+    allocTree(depth, Root, slot, slot);
+
+    releaseSomeNodes(getSlot(Root, slot));
+
+    for (int j = thread * rounds; j < slot; j++) {
+      verifyTree(getSlot(Root, j), Root, j);
+    }
+
+    if (EVACUATION && MUTATOR_THREADS == 1) {
+      // No heap pointers on the C stack here
+      gcCompact();
+    }
+
+    if (thread == 0) printf("---------\n");
+  }
+
+  if (thread > 0) gcUnregisterThread();
+  return NULL;
+}
+
 int main(){
   gcInit();
+  gcSetMarkThreads(MARK_THREADS);
+  gcEnableConcurrentMarking(CONCURRENT_MARKING);
+  gcEnableIncrementalMarking(INCREMENTAL_MARKING);
+  gcEnableLazySweeping(LAZY_SWEEPING);
+  gcEnableBackgroundSweeping(BACKGROUND_SWEEPING);
+  gcEnableHugePages(HUGE_PAGES);
+  if (HEAP_TARGET) gcSetHeapTarget((size_t)HEAP_TARGET << 20);
 
 //  gcEnableReporting(1);
 
   srand(90);
 
   Nil = alloc(0);
+  // Nil is referenced from C globals but not forwarded as a root
+  gcPin(Nil);
 
-  int rounds = 10;
-  int depth  = 5;
-
-  Root  = alloc(rounds);
-  for (int i = 0; i < rounds; i++) {
+  Root  = alloc(rounds * MUTATOR_THREADS);
+  for (int i = 0; i < rounds * MUTATOR_THREADS; i++) {
     setSlot(Root, i, Nil);
   }
 
-  for (int i = 0; i < rounds; i++) {
-    allocTree(depth, Root, i, i);
-
-    releaseSomeNodes(getSlot(Root, i));
-
-    for (int j = 0; j < i; j++) {
-      verifyTree(getSlot(Root, j), Root, j);
-    }
-
-    printf("---------\n");
+  pthread_t threads[MUTATOR_THREADS];
+  for (long t = 1; t < MUTATOR_THREADS; t++) {
+    pthread_create(&threads[t], NULL, mutator, (void*)t);
+  }
+  mutator(0);
+  // A GC waits for all registered threads, not only the running ones
+  gcUnregisterThread();
+  for (int t = 1; t < MUTATOR_THREADS; t++) {
+    pthread_join(threads[t], NULL);
   }
+  gcRegisterThread();
 
   gcTeardown();
 }